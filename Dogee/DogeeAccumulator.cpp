@@ -19,6 +19,7 @@ namespace Dogee
 	extern void RcSetRemoteEvent(int local_thread_id);
 	extern void RcResetRemoteEvent();
 	extern void RcWakeRemoteThread(int dest, int thread_id);
+	extern void RcRelease();
 
 	enum AcDataCommand
 	{
@@ -296,6 +297,8 @@ namespace Dogee
 		}
 		else
 		{
+			//the reduced results are read by the waiting threads
+			RcRelease();
 			RcDataPack cmd;
 			cmd.cmd = AcDataAccumulatePartialDone;
 			cmd.id = aid;
@@ -532,6 +535,7 @@ namespace Dogee
 
 	bool _DoAccumulateAndWait(char* in_buf, uint32_t len, int timeout, uint32_t dsm_size_of, ObjectKey okey, _BufferPrepareProc func)
 	{
+		RcRelease();
 		RcResetRemoteEvent();
 		uint32_t sz = dsm_size_of * len;
 		uint32_t blocks = (sz % DSM_CACHE_BLOCK_SIZE == 0) ? sz / DSM_CACHE_BLOCK_SIZE : sz / DSM_CACHE_BLOCK_SIZE + 1;
@@ -637,6 +641,7 @@ namespace Dogee
 			printf("Only master node can send \'Reduce\' command.\n");
 			return false;
 		}
+		RcRelease();
 		RcResetRemoteEvent();
 		RcDataPack* cmd;
 		char buf2[sizeof(RcDataPack)];
@@ -666,6 +671,7 @@ namespace Dogee
 
 	bool _Map(ObjectKey key, std::function<bool()> has_more, std::function<uint32_t(uint32_t*)> PrepareBuf, int timeout)
 	{
+		RcRelease();
 		RcResetRemoteEvent();
 
 		RcDataPack* cmd;
@@ -0,0 +1,135 @@
+#include "DogeeCacheStat.h"
+#include "DogeeEnv.h"
+#include <algorithm>
+#include <chrono>
+
+namespace Dogee
+{
+	THREAD_LOCAL int cache_stat_shard = -1;
+
+	int CacheStat::NewShard()
+	{
+		static std::atomic<int> next = ATOMIC_VAR_INIT(0);
+		return (next++) % CACHE_STAT_SHARDS;
+	}
+
+	CacheStat::CacheStat() : dump_stop(false)
+	{
+		for (int i = 0; i < CACHE_STAT_SHARDS; i++)
+		{
+			for (int j = 0; j < StatCounterCount; j++)
+				shards[i].counters[j] = 0;
+		}
+	}
+
+	CacheStat::~CacheStat()
+	{
+		StopDump();
+	}
+
+	void CacheStat::Miss(ObjectKey okey)
+	{
+		Shard& s = MyShard();
+		std::lock_guard<std::mutex> guard(s.hot_lock);
+		if (s.hot.size() >= CACHE_STAT_MAX_OBJECTS && s.hot.find(okey) == s.hot.end())
+		{
+			//the table is full. Halve the counts and forget the objects left with none
+			for (auto itr = s.hot.begin(); itr != s.hot.end();)
+			{
+				itr->second /= 2;
+				if (itr->second == 0)
+					itr = s.hot.erase(itr);
+				else
+					++itr;
+			}
+		}
+		s.hot[okey]++;
+	}
+
+	uint64_t CacheStat::Get(CacheStatCounter c)
+	{
+		uint64_t ret = 0;
+		for (int i = 0; i < CACHE_STAT_SHARDS; i++)
+			ret += shards[i].counters[c].load(std::memory_order_relaxed);
+		return ret;
+	}
+
+	const char* CacheStat::Name(CacheStatCounter c)
+	{
+		static const char* names[StatCounterCount] = {
+			"reads", "read_hits", "writes", "write_hits", "prefetches", "batch_fetches",
+			"evictions", "writebacks", "renews_sent", "renews_received",
+			"invalidations_sent", "invalidations_received", "migrations",
+			"diff_words",
+		};
+		return names[c];
+	}
+
+	void CacheStat::GetHotObjects(std::vector<std::pair<ObjectKey, uint64_t>>& out, size_t n)
+	{
+		std::unordered_map<ObjectKey, uint64_t> all;
+		for (int i = 0; i < CACHE_STAT_SHARDS; i++)
+		{
+			std::lock_guard<std::mutex> guard(shards[i].hot_lock);
+			for (auto& itr : shards[i].hot)
+				all[itr.first] += itr.second;
+		}
+		out.assign(all.begin(), all.end());
+		std::sort(out.begin(), out.end(), [](const std::pair<ObjectKey, uint64_t>& a, const std::pair<ObjectKey, uint64_t>& b){
+			return a.second > b.second;
+		});
+		if (out.size() > n)
+			out.resize(n);
+	}
+
+	void CacheStat::Reset()
+	{
+		for (int i = 0; i < CACHE_STAT_SHARDS; i++)
+		{
+			for (int j = 0; j < StatCounterCount; j++)
+				shards[i].counters[j] = 0;
+			std::lock_guard<std::mutex> guard(shards[i].hot_lock);
+			shards[i].hot.clear();
+		}
+	}
+
+	void CacheStat::Dump(FILE* f)
+	{
+		fprintf(f, "Cache stat of node %d:", DogeeEnv::self_node_id);
+		for (int i = 0; i < StatCounterCount; i++)
+			fprintf(f, " %s=%llu", Name((CacheStatCounter)i), (unsigned long long)Get((CacheStatCounter)i));
+		fprintf(f, "\n");
+		std::vector<std::pair<ObjectKey, uint64_t>> hot;
+		GetHotObjects(hot, DogeeEnv::CacheConfig::stat_hot_objects);
+		if (!hot.empty())
+		{
+			fprintf(f, "Most missed objects:");
+			for (auto& itr : hot)
+				fprintf(f, " %u(%llu)", itr.first, (unsigned long long)itr.second);
+			fprintf(f, "\n");
+		}
+		fflush(f);
+	}
+
+	void CacheStat::StartDump(int seconds)
+	{
+		StopDump();
+		dump_stop = false;
+		dumper = std::thread([this, seconds](){
+			std::unique_lock<std::mutex> lock(dump_lock);
+			while (!dump_cv.wait_for(lock, std::chrono::seconds(seconds), [this](){ return dump_stop; }))
+				Dump();
+		});
+	}
+
+	void CacheStat::StopDump()
+	{
+		{
+			std::lock_guard<std::mutex> guard(dump_lock);
+			dump_stop = true;
+		}
+		dump_cv.notify_all();
+		if (dumper.joinable())
+			dumper.join();
+	}
+}
@@ -14,6 +14,17 @@ namespace Dogee
 	extern void PushObject(ObjectKey key);
 	extern void DeleteObject(ObjectKey key);
 	extern int GetObjectNumber();
+	extern void RcRelease();
+
+	/*
+	A checkpoint file starts with CHECKPOINT_MAGIC and the layout version.
+	The file holds the raw words of the objects, so the version changes
+	whenever the field layout does. The files written before the fields
+	were laid out by their DSM size (two words per field) have no header
+	and are rejected as well
+	*/
+	#define CHECKPOINT_MAGIC 0x504b4344
+	#define CHECKPOINT_LAYOUT 2
 
 	int checkpoint_cnt = 0;
 	std::atomic<int> checkpointlock = { 0 };
@@ -48,10 +59,16 @@ namespace Dogee
 		os.write((char*)&okey, sizeof(okey));
 		os.write((char*)&size, sizeof(size));
 		os.write((char*)&flag, sizeof(flag));
+		//do not let the dump evict the blocks of the application
+		DsmStreamingScope scope;
 		for (uint32_t i = 0; i < size; i += fetch_size)
 		{
 			uint32_t the_size = MIN(fetch_size,size-i);
-			DogeeEnv::backend->getchunk(okey, i, the_size, buf);
+			//if the home nodes own the blocks, the backend may be stale
+			if (DogeeEnv::CacheConfig::home_owned_blocks)
+				DogeeEnv::cache->getchunk(okey, i, the_size, buf);
+			else
+				DogeeEnv::backend->getchunk(okey, i, the_size, buf);
 			for (size_t j = 0; j < the_size; j++)
 			{
 				os.write((char*)&buf[j], sizeof(buf[j]));
@@ -92,6 +109,13 @@ namespace Dogee
 		checkpoint_cnt++;
 		std::ifstream f(path.str(), std::ios::binary);
 		assert(f);
+		uint32_t header[2] = { 0, 0 };
+		f.read((char*)header, sizeof(header));
+		if (header[0] != CHECKPOINT_MAGIC || header[1] != CHECKPOINT_LAYOUT)
+		{
+			printf("Checkpoint %s has another object layout, it cannot be restored\n", path.str().c_str());
+			abort();
+		}
 		//dump the static variables
 		if (DogeeEnv::isMaster())
 		{
@@ -112,6 +136,8 @@ namespace Dogee
 
 	static bool DoCheckPoint()
 	{
+		//the dump reads the backend and the home blocks, so send the pending writes of this thread first
+		RcRelease();
 		if (!DogeeEnv::checkboject)
 			return false;
 		if (checkpointlock.exchange(1) == 1)
@@ -122,6 +148,8 @@ namespace Dogee
 		path << DogeeEnv::application_name << "."<< DogeeEnv::self_node_id<<"."<< checkpoint_cnt<<".checkpoint";
 		std::ofstream f(path.str(), std::ios::binary);
 		assert(f);
+		uint32_t header[2] = { CHECKPOINT_MAGIC, CHECKPOINT_LAYOUT };
+		f.write((char*)header, sizeof(header));
 		//dump the static variables
 		if (DogeeEnv::isMaster())
 			DumpSharedMemory(0, gloabl_fid, 0xFFFFFFFF, f);
@@ -133,6 +161,7 @@ namespace Dogee
 			DumpSharedMemory(key, size, flag,f);
 		});
 		funcCheckPoint();
+		DogeeEnv::cache->FlushToBackend();
 		//dump the checkpoint object
 		funcSerialize(f);
 		if (DogeeEnv::isMaster())
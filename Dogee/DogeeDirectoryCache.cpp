@@ -13,8 +13,112 @@ namespace Dogee
 		return cnt++;
 	}
 
+	//the flag is set before the version changes, see DSMDirectoryCache::doget
+	static inline void MarkInvalid(CacheBlock* blk)
+	{
+		blk->invalid = true;
+		blk->version++;
+	}
+
+#ifndef _WIN32
+	//the epoll data of stop_fd
+	#define CACHE_SERVER_STOP 0xffffffffu
+
+	void DSMDirectoryCache::DSMCacheProtocal::StartServer()
+	{
+		epoll_fd=epoll_create1(0);
+		stop_fd=eventfd(0,0);
+		if(epoll_fd<0 || stop_fd<0)
+		{
+			printf("Cache server epoll error %d\n",errno);
+			_BreakPoint;
+		}
+		epoll_event ev;
+		//level triggered, so that every server thread sees it
+		ev.events=EPOLLIN;
+		ev.data.u32=CACHE_SERVER_STOP;
+		epoll_ctl(epoll_fd,EPOLL_CTL_ADD,stop_fd,&ev);
+		for(int i=0;i<caches;i++)
+		{
+			if(i==ths->cache_id)
+				continue;
+			ev.events=EPOLLIN | EPOLLONESHOT;
+			ev.data.u32=i;
+			if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,(int)controlsockets[i],&ev)!=0)
+			{
+				printf("Cache server epoll_ctl error %d\n",errno);
+				_BreakPoint;
+			}
+		}
+		int n=DogeeEnv::CacheConfig::protocal_threads;
+		if(n<1)
+			n=1;
+		for(int i=0;i<n;i++)
+			server_threads.push_back(std::thread(ServerProc,this));
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::StopServer()
+	{
+		uint64_t one=1;
+		if(write(stop_fd,&one,sizeof(one))!=sizeof(one))
+			printf("Cache server stop error %d\n",errno);
+		for(auto& th : server_threads)
+			th.join();
+		server_threads.clear();
+		close(epoll_fd);
+		close(stop_fd);
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::ServerProc(DSMCacheProtocal* ths)
+	{
+		DogeeEnv::InitCurrentThread();
+		DataPack pack;
+		for(;;)
+		{
+			epoll_event ev;
+			int n=epoll_wait(ths->epoll_fd,&ev,1,-1);
+			if(n<0 && errno==EINTR)
+				continue;
+			if(n<0)
+			{
+				printf("Cache server epoll error %d\n",errno);
+				break;
+			}
+			if(n==0)
+				continue;
+			if(ev.data.u32==CACHE_SERVER_STOP)
+				break;
+			int target_id=ev.data.u32;
+			SOCKET s=ths->controlsockets[target_id];
+			bool ok=true;
+			for(int i=0;i<CACHE_SERVER_BATCH;i++)
+			{
+				if(!RecvPack(s,pack))
+				{
+					printf("Cache server socket error %d\n", RcSocketLastError());
+					ok=false;
+					break;
+				}
+				ths->HandlePack(target_id,pack);
+				//go on only if the next message has arrived
+				char c;
+				if(recv((int)s,&c,1,MSG_PEEK | MSG_DONTWAIT)<=0)
+					break;
+			}
+			//a closed socket is not re-armed
+			if(ok)
+			{
+				ev.events=EPOLLIN | EPOLLONESHOT;
+				ev.data.u32=target_id;
+				epoll_ctl(ths->epoll_fd,EPOLL_CTL_MOD,(int)s,&ev);
+			}
+		}
+	}
+#endif
+
 	void DSMDirectoryCache::DSMCacheProtocal::ServerRenew(uint64_t addr, int src_id, uint32_t * v, uint32_t len)
 	{
+		ths->stat.Inc(StatRenewsReceived);
 
 
 		//	printf("renew : %lld[%lld]=%d\n",addr>>32,addr &0xffffffff,v.vi);
@@ -30,22 +134,25 @@ namespace Dogee
 			{
 				if (blk->key == (addr & DSM_CACHE_HIGH_MASK_64))
 				{
-					memcpy(blk->cache + (addr & DSM_CACHE_LOW_MASK_64), v, sizeof(blk->cache[0])*len);
+					ths->renewblock(blk, addr & DSM_CACHE_LOW_MASK_64, v, len, true);
+					CountRenew(blk, addr & DSM_CACHE_HIGH_MASK_64, src_id);
 				}
 				else
 					printf("Discard write changed key : [%lu->%lu]=%u->%u\n",addr &0xffffffff,blk->key,blk->cache[addr & DSM_CACHE_LOW_MASK],*v);
 				UaLeaveReadRWLock(&blk->lock);
 			}
 			else
-            {
-                printf("Discard write : [%lu]=%u->%u\n",addr &0xffffffff,blk->cache[addr & DSM_CACHE_LOW_MASK],*v);
-            }
+			{
+				//the block is being filled or swapped out. Read it again instead of losing the update
+				MarkInvalid(blk);
+			}
 			//printf("Renew!!! index=%llx,value=%d\n",addr ,v.vi);
 		}
 	}
 
 	void DSMDirectoryCache::DSMCacheProtocal::ServerRenewChunk(uint64_t addr, int src_id, uint32_t* v)
 	{
+		ths->stat.Inc(StatRenewsReceived);
 		UaEnterReadRWLock(&ths->hash_lock);
 		hash_iterator itr=ths->cache.find(addr & DSM_CACHE_HIGH_MASK_64);
 		bool found=(itr!=ths->cache.end());
@@ -56,242 +163,782 @@ namespace Dogee
 			if(UaTryEnterReadRWLock(&blk->lock))
 			{
 				if(blk->key== (addr & DSM_CACHE_HIGH_MASK_64))
-					memcpy(blk->cache, v, sizeof(blk->cache[0])*DSM_CACHE_BLOCK_SIZE);
+				{
+					ths->renewblock(blk, 0, v, DSM_CACHE_BLOCK_SIZE, true);
+					CountRenew(blk, addr & DSM_CACHE_HIGH_MASK_64, src_id);
+				}
 				else
 					printf("Discard write changed key : [%lu->%lu]=%u->\n",addr &0xffffffff,blk->key,blk->cache[addr & DSM_CACHE_LOW_MASK]);
 				UaLeaveReadRWLock(&blk->lock);
 			}
 			else
-            {
-                printf("Discard write : [%lu]=%u-\n",addr &0xffffffff,blk->cache[addr & DSM_CACHE_LOW_MASK]);
-            }
+			{
+				MarkInvalid(blk);
+			}
 			//printf("Renew!!! index=%llx,value=%d\n",addr ,v.vi);
 		}
 	}
 
-	void DSMDirectoryCache::DSMCacheProtocal::ServerWrite(uint64_t addr,int src_id,uint32_t* v,uint32_t len)
+	void DSMDirectoryCache::DSMCacheProtocal::CountRenew(CacheBlock* blk, uint64_t baddr, int src_id)
 	{
-		bool islocal= (src_id==ths->cache_id);
-		uint64_t baddr=addr & DSM_CACHE_HIGH_MASK_64;
-		if(!islocal &&  ((addr>>DSM_CACHE_BITS) % caches!=ths->cache_id))
-		{
-			//RcSend(datasockets[src_id],&status,sizeof(status));
-			printf("Cache server bad address!!!%lx\n",addr);
-			_BreakPoint;
+		//the renews of the home itself cost no messages
+		if(DogeeEnv::CacheConfig::coherence!=DogeeEnv::CacheConfig::CoherenceAdaptive || src_id==ths->cache_id)
 			return;
+		if(++blk->unread_renews==DogeeEnv::CacheConfig::coherence_drop_updates)
+		{
+			ths->stat.Inc(StatWritebacks);
+			/*
+			Leave the sharers before marking the block, so that the read miss
+			of a later refetch can not reach the home before the writeback
+			*/
+			DataPack pack = { baddr, MsgWriteback, 0 };
+			SendPack(controlsockets[src_id],pack);
+			MarkInvalid(blk);
 		}
-		ths->backend->putchunk(addr>>32,(addr & 0xffffffff),len,v);
-		//printf("WRITE!!!!! [%llx]=%d\n",addr,v.vi);
-		UaEnterReadRWLock(&dir_lock);
-		dir_iterator itr=directory.find(baddr);
-		uint64_t old=0;
-		if(itr!=directory.end())
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::ServerInvalidate(uint64_t baddr, int src_id)
+	{
+		ths->stat.Inc(StatInvalidationsReceived);
+		UaEnterReadRWLock(&ths->hash_lock);
+		hash_iterator itr=ths->cache.find(baddr);
+		if(itr!=ths->cache.end())
+			MarkInvalid(itr->second);
+		UaLeaveReadRWLock(&ths->hash_lock);
+	}
+
+	DSMDirectoryCache::DSMCacheProtocal::HomeBlock* DSMDirectoryCache::DSMCacheProtocal::HomeLoad(uint64_t baddr)
+	{
+		auto itr=home_blocks.find(baddr);
+		if(itr!=home_blocks.end())
+			return &itr->second;
+		HomeBlock hblk;
+		if(ths->backend->getblock(baddr,hblk.data)!=SoOK)
+			return NULL;
+		hblk.dirty=0;
+		while((int)home_order.size()>=DogeeEnv::CacheConfig::home_max_blocks)
 		{
-			old=itr->second;
+			uint64_t old=home_order.front();
+			home_order.pop();
+			auto olditr=home_blocks.find(old);
+			if(olditr!=home_blocks.end())
+			{
+				HomeWriteback(old,olditr->second);
+				home_blocks.erase(olditr);
+			}
 		}
-		if(old)
+		home_order.push(baddr);
+		return &(home_blocks[baddr]=hblk);
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::HomeWriteback(uint64_t baddr, HomeBlock& hblk)
+	{
+		//write each run of dirty words with one putchunk
+		uint32_t i=0;
+		while(hblk.dirty)
 		{
-			DataPack sendpack;
-			sendpack.kind=MsgRenew;
-			sendpack.addr=addr;
-			sendpack.len = len;
-			memcpy(sendpack.buf, v, sizeof(sendpack.buf[0])*len);
-			for(int i=0;i<caches;i++)
+			if(!(hblk.dirty & (1u<<i)))
 			{
-				if((old & 1) && src_id!=i)
-				{
-					if(i==ths->cache_id)
-					{
-						ServerRenew(addr,i,v,len);
-					}
-					else
-					{
-						RcSend(controlsockets[i],&sendpack,sizeof(sendpack));
-					}
-				}
-				old=old>>1;
+				i++;
+				continue;
+			}
+			uint32_t start=i;
+			while(i<DSM_CACHE_BLOCK_SIZE && (hblk.dirty & (1u<<i)))
+			{
+				hblk.dirty &= ~(1u<<i);
+				i++;
 			}
+			ths->backend->putchunk(baddr>>32,(baddr & 0xffffffff)+start,i-start,hblk.data+start);
 		}
-		if(!islocal)
+	}
+
+	SoStatus DSMDirectoryCache::DSMCacheProtocal::HomeGetBlock(uint64_t baddr, uint32_t* outbuf)
+	{
+		if(!home_owned)
+			return ths->backend->getblock(baddr,outbuf);
+		std::lock_guard<std::mutex> guard(home_lock);
+		HomeBlock* hblk=HomeLoad(baddr);
+		if(!hblk)
+			return SoFail;
+		memcpy(outbuf,hblk->data,sizeof(hblk->data));
+		return SoOK;
+	}
+
+	SoStatus DSMDirectoryCache::DSMCacheProtocal::HomePut(uint64_t addr, uint32_t* v, uint32_t len)
+	{
+		if(!home_owned)
+			return ths->backend->putchunk(addr>>32,(addr & 0xffffffff),len,v);
+		std::lock_guard<std::mutex> guard(home_lock);
+		HomeBlock* hblk=HomeLoad(addr & DSM_CACHE_HIGH_MASK_64);
+		if(!hblk)
+			return ths->backend->putchunk(addr>>32,(addr & 0xffffffff),len,v);
+		uint32_t offset=addr & DSM_CACHE_LOW_MASK_64;
+		memcpy(hblk->data+offset,v,sizeof(v[0])*len);
+		for(uint32_t i=offset;i<offset+len;i++)
+			hblk->dirty |= 1u<<i;
+		return SoOK;
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::FlushHomeBlocks()
+	{
+		if(!home_owned)
+			return;
+		std::lock_guard<std::mutex> guard(home_lock);
+		for(auto& itr : home_blocks)
 		{
-			ServerWriteReply reply={addr};
-			RcSend(datasockets[src_id],&reply,sizeof(reply));
+			if(itr.second.dirty)
+				HomeWriteback(itr.first,itr.second);
 		}
-		UaLeaveReadRWLock(&dir_lock);
 	}
 
-	void DSMDirectoryCache::DSMCacheProtocal::ServerWriteback(uint64_t addr,int src_id)
+	void DSMDirectoryCache::DSMCacheProtocal::RenewSharers(const DirectoryEntry& entry, uint64_t addr, int src_id, uint32_t* v, uint32_t len)
 	{
-		if(((addr>>DSM_CACHE_BITS) % caches!=ths->cache_id))
+		if(entry.sharers.empty())
+			return;
+		DataPack sendpack;
+		sendpack.kind=MsgRenew;
+		sendpack.addr=addr;
+		sendpack.len = len;
+		memcpy(sendpack.buf, v, sizeof(sendpack.buf[0])*len);
+		for(int i : entry.sharers)
 		{
-			printf("Cache server bad address!!!%lx\n",addr);
-			_BreakPoint;
+			if(i==src_id)
+				continue;
+			if(i==ths->cache_id)
+			{
+				ServerRenew(addr,i,v,len);
+			}
+			else
+			{
+				ths->stat.Inc(StatRenewsSent);
+				SendPack(controlsockets[i],sendpack);
+				coh_sent[i]++;
+			}
 		}
-		UaEnterWriteRWLock(&dir_lock);
-		dir_iterator itr=directory.find(addr);
-		if(itr!=directory.end())
+	}
+
+	bool DSMDirectoryCache::DSMCacheProtocal::InvalidateSharers(DirectoryEntry& entry, uint64_t baddr, int src_id)
+	{
+		DataPack sendpack = { baddr, MsgInvalidate, 0 };
+		for(int i : entry.sharers)
 		{
-			uint64_t old;
-			old=itr->second;
-			uint64_t newv = old & ~( ((uint64_t)1)<< src_id);
-			if(newv)
-				directory[addr]=newv;
+			if(i==src_id)
+				continue;
+			if(i==ths->cache_id)
+				ServerInvalidate(baddr,i);
 			else
-				directory.erase(addr);
+			{
+				ths->stat.Inc(StatInvalidationsSent);
+				SendPack(controlsockets[i],sendpack);
+				coh_sent[i]++;
+			}
 		}
+		bool keep=entry.has(src_id);
+		entry.sharers.clear();
+		if(keep)
+			entry.sharers.push_back(src_id);
+		return !keep;
+	}
 
-		UaLeaveWriteRWLock(&dir_lock);
+	//the homes a thread has written to since its last Sync
+	struct SyncHomes
+	{
+		//the instance_id of the cache the homes belong to
+		uint32_t owner;
+		int n;
+		//more than CACHE_SYNC_HOMES homes, so all the nodes are synced
+		bool all;
+		int homes[CACHE_SYNC_HOMES];
+	};
+	static THREAD_LOCAL SyncHomes sync_homes;
+
+	void DSMDirectoryCache::DSMCacheProtocal::AddSyncHome(int home)
+	{
+		SyncHomes& sh=sync_homes;
+		if(sh.owner!=ths->instance_id)
+		{
+			sh.owner=ths->instance_id;
+			sh.n=0;
+			sh.all=false;
+		}
+		if(sh.all)
+			return;
+		for(int i=0;i<sh.n;i++)
+		{
+			if(sh.homes[i]==home)
+				return;
+		}
+		if(sh.n==CACHE_SYNC_HOMES)
+			sh.all=true;
+		else
+			sh.homes[sh.n++]=home;
+	}
 
+	std::vector<uint64_t> DSMDirectoryCache::DSMCacheProtocal::SyncTargets(int src_id)
+	{
+		std::vector<uint64_t> targets(caches,0);
+		for(int i=0;i<caches;i++)
+		{
+			//the writer needs no mark of the messages sent to itself
+			if(i==ths->cache_id || i==src_id)
+				continue;
+			uint64_t sent=coh_sent[i];
+			targets[i]=sent;
+			if(mark_sent[i]<sent)
+			{
+				mark_sent[i]=sent;
+				DataPack pack = { sent, MsgSyncMark, 0 };
+				SendPack(controlsockets[i],pack);
+			}
+		}
+		return targets;
 	}
 
+	bool DSMDirectoryCache::DSMCacheProtocal::SyncDone(const std::vector<uint64_t>& targets)
+	{
+		for(int i=0;i<caches;i++)
+		{
+			if(mark_acked[i]<targets[i])
+				return false;
+		}
+		return true;
+	}
 
-	DSMDirectoryCache::DSMCacheProtocal::CacheMessageKind DSMDirectoryCache::DSMCacheProtocal::ServerWriteMiss(uint64_t addr,int src_id,uint32_t* v,uint32_t in_len,uint32_t* outbuf)
+	void DSMDirectoryCache::DSMCacheProtocal::ServerSync(int src_id)
 	{
-		bool islocal= (src_id==ths->cache_id);
-		uint64_t baddr=addr & DSM_CACHE_HIGH_MASK_64;
-		CacheMessageKind status=MsgReplyOK;
-		if(!islocal &&  ((addr>>DSM_CACHE_BITS) % caches!=ths->cache_id))
+		std::lock_guard<std::mutex> guard(sync_lock);
+		PendingSync p = { src_id, SyncTargets(src_id) };
+		if(SyncDone(p.targets))
 		{
-			printf("Cache server bad address!!!%lx\n",addr);
-			_BreakPoint;
+			DataPack reply = { 0, MsgReplyOK, 0 };
+			SendPack(datasockets[src_id],reply);
+		}
+		else
+		{
+			//answered by ServerSyncAck. The sender waits for the reply, so it has no other request to this node
+			pending_syncs.push_back(p);
 		}
+	}
 
-		ths->backend->putchunk( addr>>32,(addr&0xffffffff),in_len,v);
-		//printf("WRITE Miss!!!!! [%llx]=%d\n",addr,v.vi);
+	void DSMDirectoryCache::DSMCacheProtocal::ServerSyncMark(uint64_t count, int src_id)
+	{
+		//the messages of src_id before the mark are all handled
+		DataPack pack = { count, MsgSyncMarkAck, 0 };
+		SendPack(controlsockets[src_id],pack);
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::ServerSyncAck(uint64_t count, int src_id)
+	{
+		std::lock_guard<std::mutex> guard(sync_lock);
+		if(count>mark_acked[src_id])
+			mark_acked[src_id]=count;
+		for(size_t i=0;i<pending_syncs.size();)
+		{
+			if(!SyncDone(pending_syncs[i].targets))
+			{
+				i++;
+				continue;
+			}
+			DataPack reply = { 0, MsgReplyOK, 0 };
+			SendPack(datasockets[pending_syncs[i].src],reply);
+			pending_syncs[i]=pending_syncs.back();
+			pending_syncs.pop_back();
+		}
+		sync_cv.notify_all();
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::Sync()
+	{
+		SyncHomes& sh=sync_homes;
+		if(sh.owner!=ths->instance_id || (!sh.n && !sh.all))
+			return;
+		std::vector<bool> homes(caches,sh.all);
+		for(int i=0;i<sh.n;i++)
+			homes[sh.homes[i]]=true;
+		sh.n=0;
+		sh.all=false;
+		//as in MultiMiss, send all the requests before waiting, taking the locks in the order of the home ids
+		for(int h=0;h<caches;h++)
+		{
+			if(!homes[h] || h==ths->cache_id)
+				continue;
+			UaEnterLock(&datasocketlocks[h]);
+			DataPack pack = { 0, MsgSync, 0 };
+			SendPack(controlsockets[h],pack);
+		}
+		if(homes[ths->cache_id])
+		{
+			std::unique_lock<std::mutex> lock(sync_lock);
+			std::vector<uint64_t> targets=SyncTargets(ths->cache_id);
+			sync_cv.wait(lock,[&]{ return SyncDone(targets); });
+		}
+		for(int h=0;h<caches;h++)
+		{
+			if(!homes[h] || h==ths->cache_id)
+				continue;
+			DataPack pack;
+			if(!RecvPack(datasockets[h],pack))
+				printf("Sync receive error %d\n",RcSocketLastError());
+			UaLeaveLock(&datasocketlocks[h]);
+		}
+	}
+
+	int DSMDirectoryCache::DSMCacheProtocal::HomeOf(uint64_t addr)
+	{
+		if(relocated)
+		{
+			UaEnterReadRWLock(&homes_lock);
+			auto itr=homes.find(addr & DSM_CACHE_HIGH_MASK_64);
+			int ret=(itr!=homes.end())?itr->second:-1;
+			UaLeaveReadRWLock(&homes_lock);
+			if(ret>=0)
+				return ret;
+		}
+		return (addr>>DSM_CACHE_BITS) % caches;
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::SetHome(uint64_t baddr, int home)
+	{
+		UaEnterWriteRWLock(&homes_lock);
+		homes[baddr]=home;
+		relocated=true;
+		UaLeaveWriteRWLock(&homes_lock);
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::Redirect(uint64_t addr, int home)
+	{
+		//the block is moving here. Ask the old home again until the move arrives
+		if(home==ths->cache_id)
+			std::this_thread::yield();
+		else
+			SetHome(addr & DSM_CACHE_HIGH_MASK_64,home);
+	}
 
+	bool DSMDirectoryCache::DSMCacheProtocal::CountWrite(uint64_t baddr, int src_id)
+	{
+		int threshold=DogeeEnv::CacheConfig::migrate_writes;
+		if(threshold<=0)
+			return false;
+		std::lock_guard<std::mutex> guard(writer_lock);
+		WriterStat& st=writer_stats[baddr];
+		if(st.writer!=src_id)
+		{
+			st.writer=src_id;
+			st.run=0;
+		}
+		if(++st.run<threshold || src_id==ths->cache_id)
+			return false;
+		writer_stats.erase(baddr);
+		return true;
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::Migrate(uint64_t baddr, int to)
+	{
 		UaEnterWriteRWLock(&dir_lock);
+		if(HomeOf(baddr)!=ths->cache_id)
+		{
+			UaLeaveWriteRWLock(&dir_lock);
+			return;
+		}
+		DataPack pack = { baddr, MsgMigrate, 0 };
 		dir_iterator itr=directory.find(baddr);
-		uint64_t old=0;
 		if(itr!=directory.end())
 		{
-			old=itr->second;
+			//the sharers should fit in one message
+			if(itr->second.sharers.size()>DSM_CACHE_BLOCK_SIZE)
+			{
+				UaLeaveWriteRWLock(&dir_lock);
+				return;
+			}
+			for(int i : itr->second.sharers)
+				pack.buf[pack.len++]=i;
+			directory.erase(itr);
+		}
+		if(home_owned)
+		{
+			//the new home loads the block from the backend
+			std::lock_guard<std::mutex> guard(home_lock);
+			auto hitr=home_blocks.find(baddr);
+			if(hitr!=home_blocks.end())
+			{
+				HomeWriteback(baddr,hitr->second);
+				home_blocks.erase(hitr);
+			}
 		}
-		uint64_t newv = old | ( ((uint64_t)1)<< src_id);
-		directory[baddr]=newv;
+		SetHome(baddr,to);
+		ths->stat.Inc(StatMigrations);
+		SendPack(controlsockets[to],pack);
+		UaLeaveWriteRWLock(&dir_lock);
+	}
 
-		if(old)
+	void DSMDirectoryCache::DSMCacheProtocal::ServerMigrate(uint64_t baddr, uint32_t* sharers, uint32_t n)
+	{
+		UaEnterWriteRWLock(&dir_lock);
+		if(n)
 		{
-			DataPack sendpack;
-			sendpack.kind=MsgRenew;
-			sendpack.addr=addr;
-			sendpack.len = in_len;
-			memcpy(sendpack.buf, v, sizeof(sendpack.buf[0])*in_len);
-			for(int i=0;i<caches;i++)
+			DirectoryEntry& entry=directory[baddr];
+			for(uint32_t i=0;i<n;i++)
+				entry.add(sharers[i]);
+		}
+		SetHome(baddr,ths->cache_id);
+		UaLeaveWriteRWLock(&dir_lock);
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::SendMoved(uint64_t addr, int src_id, int home)
+	{
+		DataPack sendpack = { addr, MsgReplyMoved, 1 };
+		sendpack.buf[0]=home;
+		SendPack(datasockets[src_id],sendpack);
+	}
+
+	int DSMDirectoryCache::DSMCacheProtocal::ServerWrite(uint64_t addr,int src_id,uint32_t* v,uint32_t len)
+	{
+		bool islocal= (src_id==ths->cache_id);
+		uint64_t baddr=addr & DSM_CACHE_HIGH_MASK_64;
+		//invalidation changes the directory, so it needs the write lock
+		bool invalidate=Invalidates(addr);
+		if(invalidate)
+			UaEnterWriteRWLock(&dir_lock);
+		else
+			UaEnterReadRWLock(&dir_lock);
+		//the home is checked with dir_lock held, so that the block can not move meanwhile
+		int home=HomeOf(addr);
+		if(home==ths->cache_id)
+		{
+			HomePut(addr,v,len);
+			//printf("WRITE!!!!! [%llx]=%d\n",addr,v.vi);
+			dir_iterator itr=directory.find(baddr);
+			if(itr!=directory.end())
 			{
-				if((old & 1) && src_id!=i)
-				{
-					if(i==ths->cache_id)
-					{
-						ServerRenew(addr,i,v,in_len);
-					}
-					else
-					{
-						RcSend(controlsockets[i],&sendpack,sizeof(sendpack));
-					}
-				}
-				old=old>>1;
+				if(!invalidate)
+					RenewSharers(itr->second,addr,src_id,v,len);
+				else if(InvalidateSharers(itr->second,baddr,src_id))
+					directory.erase(itr);
+			}
+			home=-1;
+		}
+		if(!islocal)
+		{
+			ServerWriteReply reply={addr,home};
+			RcSend(datasockets[src_id],&reply,sizeof(reply));
+		}
+		if(invalidate)
+			UaLeaveWriteRWLock(&dir_lock);
+		else
+			UaLeaveReadRWLock(&dir_lock);
+		if(home<0 && CountWrite(baddr,src_id))
+			Migrate(baddr,src_id);
+		return home;
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::ServerWriteback(uint64_t addr,int src_id)
+	{
+		UaEnterWriteRWLock(&dir_lock);
+		//a writeback to an old home is dropped. The new home only renews a block the cache no longer has
+		if(HomeOf(addr)==ths->cache_id)
+		{
+			dir_iterator itr=directory.find(addr);
+			if(itr!=directory.end())
+			{
+				if(itr->second.remove(src_id))
+					directory.erase(itr);
 			}
 		}
+		UaLeaveWriteRWLock(&dir_lock);
+
+	}
+
+
+	DSMDirectoryCache::DSMCacheProtocal::CacheMessageKind DSMDirectoryCache::DSMCacheProtocal::ServerWriteMiss(uint64_t addr,int src_id,uint32_t* v,uint32_t in_len,uint32_t* outbuf)
+	{
+		bool islocal= (src_id==ths->cache_id);
+		uint64_t baddr=addr & DSM_CACHE_HIGH_MASK_64;
+		CacheMessageKind status=MsgReplyOK;
+
+		UaEnterWriteRWLock(&dir_lock);
+		int home=HomeOf(addr);
+		if(home!=ths->cache_id)
+		{
+			if(!islocal)
+				SendMoved(addr,src_id,home);
+			UaLeaveWriteRWLock(&dir_lock);
+			return MsgReplyMoved;
+		}
+		HomePut(addr,v,in_len);
+		//printf("WRITE Miss!!!!! [%llx]=%d\n",addr,v.vi);
+
+		DirectoryEntry& entry=directory[baddr];
+		if(Invalidates(addr))
+			InvalidateSharers(entry,baddr,src_id);
+		else
+			RenewSharers(entry,addr,src_id,v,in_len);
+		entry.add(src_id);
 
 		////////////////////////////////////////////////////
 
 		if(islocal)
 		{
-			if(ths->backend->getblock(baddr,outbuf)!=SoOK)
-			{
-				UaLeaveWriteRWLock(&dir_lock);
-				return MsgReplyBadAddress;
-			}
+			if(HomeGetBlock(baddr,outbuf)!=SoOK)
+				status=MsgReplyBadAddress;
 		}
 		else
 		{
 			DataPack sendpack;
 			sendpack.kind=MsgReplyOK;
 			sendpack.addr=addr;
-			if(ths->backend->getblock(baddr,sendpack.buf)!=SoOK)
+			sendpack.len=DSM_CACHE_BLOCK_SIZE;
+			if(HomeGetBlock(baddr,sendpack.buf)!=SoOK)
 			{
 				sendpack.kind=MsgReplyBadAddress;
+				sendpack.len=0;
 			}
-			RcSend(datasockets[src_id],&sendpack,sizeof(sendpack));
+			SendPack(datasockets[src_id],sendpack);
 		}
 		UaLeaveWriteRWLock(&dir_lock);
+		if(status==MsgReplyOK && CountWrite(baddr,src_id))
+			Migrate(baddr,src_id);
 		return status;
 	}
 
-	DSMDirectoryCache::DSMCacheProtocal::CacheMessageKind DSMDirectoryCache::DSMCacheProtocal::ServerReadMiss(uint64_t addr,int src_id,uint32_t* outbuf)
+	DSMDirectoryCache::DSMCacheProtocal::CacheMessageKind DSMDirectoryCache::DSMCacheProtocal::ServerReadMiss(uint64_t addr,int src_id,uint32_t* outbuf,bool share)
 	{
 		bool islocal= (src_id==ths->cache_id);
 		CacheMessageKind status=MsgReplyOK;
-		if(!islocal &&  ((addr>>DSM_CACHE_BITS) % caches!=ths->cache_id))
-		{
-			printf("Cache server bad address!!!%lx\n",addr);
-			_BreakPoint;
-		}
-		UaEnterWriteRWLock(&dir_lock);
-		dir_iterator itr=directory.find(addr);
-		uint64_t old=0;
-		if(itr!=directory.end())
+		//an uncached read leaves no directory entry
+		if(share)
+			UaEnterWriteRWLock(&dir_lock);
+		else
+			UaEnterReadRWLock(&dir_lock);
+		int home=HomeOf(addr);
+		if(home!=ths->cache_id)
 		{
-			old=itr->second;
+			if(!islocal)
+				SendMoved(addr,src_id,home);
+			status=MsgReplyMoved;
 		}
-		uint64_t newv = old | ( ((uint64_t)1)<< src_id);
-		directory[addr]=newv;
-
-		if(islocal)
+		else if(islocal)
 		{
-			if(ths->backend->getblock(addr,outbuf)!=SoOK)
-			{
-				UaLeaveWriteRWLock(&dir_lock);
-				return MsgReplyBadAddress;
-			}
+			if(share)
+				directory[addr].add(src_id);
+			if(HomeGetBlock(addr,outbuf)!=SoOK)
+				status=MsgReplyBadAddress;
 		}
 		else
 		{
+			if(share)
+				directory[addr].add(src_id);
 			DataPack sendpack;
 			sendpack.kind=MsgReplyOK;
 			sendpack.addr=addr;
-			if(ths->backend->getblock(addr,sendpack.buf)!=SoOK)
+			sendpack.len=DSM_CACHE_BLOCK_SIZE;
+			if(HomeGetBlock(addr,sendpack.buf)!=SoOK)
 			{
 				sendpack.kind=MsgReplyBadAddress;
+				sendpack.len=0;
 			}
-			RcSend(datasockets[src_id],&sendpack,sizeof(sendpack));
+			SendPack(datasockets[src_id],sendpack);
 		}
-		UaLeaveWriteRWLock(&dir_lock);
+		if(share)
+			UaLeaveWriteRWLock(&dir_lock);
+		else
+			UaLeaveReadRWLock(&dir_lock);
 
 		return status;
 	}
 
 
+	void DSMDirectoryCache::DSMCacheProtocal::MultiMiss(int n, uint64_t* addrs, uint32_t** wdata, CacheBlock** blks, SoStatus* status)
+	{
+		std::vector<std::vector<int>> byhome(caches);
+		//the blocks whose home has moved, to be fetched one by one at last
+		std::vector<int> moved;
+		for(int i=0;i<n;i++)
+		{
+			status[i]=SoFail;
+			int home=HomeOf(addrs[i]);
+			byhome[home].push_back(i);
+			if(wdata[i])
+				AddSyncHome(home);
+		}
+		for(int i : byhome[ths->cache_id])
+		{
+			CacheMessageKind r = wdata[i] ? ServerWriteMiss(addrs[i],ths->cache_id,wdata[i],DSM_CACHE_BLOCK_SIZE,blks[i]->cache)
+				: ServerReadMiss(addrs[i],ths->cache_id,blks[i]->cache);
+			if(r==MsgReplyOK)
+			{
+				blks[i]->key=addrs[i];
+				status[i]=SoOK;
+			}
+			else if(r==MsgReplyMoved)
+				moved.push_back(i);
+		}
+		byhome[ths->cache_id].clear();
+
+		/*
+		Send all the requests before waiting for any reply. The data socket
+		locks are taken in the order of the home ids to avoid deadlocks. The
+		replies of a home come in the order of "sent"
+		*/
+		std::vector<std::vector<int>> sent(caches);
+		for(int h=0;h<caches;h++)
+		{
+			if(byhome[h].empty())
+				continue;
+			UaEnterLock(&datasocketlocks[h]);
+			DataPack pack = { 0, MsgReadMissBatch, 0 };
+			for(int i : byhome[h])
+			{
+				if(wdata[i])
+					continue;
+				memcpy(pack.buf+pack.len,&addrs[i],sizeof(uint64_t));
+				pack.len+=sizeof(uint64_t)/sizeof(uint32_t);
+				sent[h].push_back(i);
+				if(pack.len+sizeof(uint64_t)/sizeof(uint32_t)>DSM_CACHE_BLOCK_SIZE)
+				{
+					SendPack(controlsockets[h],pack);
+					pack.len=0;
+				}
+			}
+			if(pack.len)
+				SendPack(controlsockets[h],pack);
+			for(int i : byhome[h])
+			{
+				if(!wdata[i])
+					continue;
+				DataPack wpack = { addrs[i], MsgWriteMiss, DSM_CACHE_BLOCK_SIZE };
+				memcpy(wpack.buf,wdata[i],sizeof(wpack.buf));
+				SendPack(controlsockets[h],wpack);
+				sent[h].push_back(i);
+			}
+		}
+		for(int h=0;h<caches;h++)
+		{
+			if(sent[h].empty())
+				continue;
+			//every reply is read, even after an error, so that the next request on the socket does not get it
+			for(int i : sent[h])
+			{
+				DataPack pack;
+				if(!RecvPack(datasockets[h],pack))
+				{
+					printf("Batch miss receive error %d\n",RcSocketLastError());
+					continue;
+				}
+				if(pack.addr!=addrs[i])
+				{
+					printf("Batch miss return a bad addr\n");
+					_BreakPoint;
+					continue;
+				}
+				if(pack.kind==MsgReplyOK && pack.len==DSM_CACHE_BLOCK_SIZE)
+				{
+					memcpy(blks[i]->cache,pack.buf,sizeof(pack.buf));
+					blks[i]->key=addrs[i];
+					status[i]=SoOK;
+				}
+				else if(pack.kind==MsgReplyMoved)
+				{
+					Redirect(addrs[i],pack.buf[0]);
+					moved.push_back(i);
+				}
+			}
+			UaLeaveLock(&datasocketlocks[h]);
+		}
+		for(int i : moved)
+			status[i] = wdata[i] ? WriteMiss(addrs[i],wdata[i],DSM_CACHE_BLOCK_SIZE,blks[i]) : ReadMiss(addrs[i],blks[i]);
+	}
+
+	void DSMDirectoryCache::DSMCacheProtocal::MultiWrite(int n, uint64_t* addrs, uint32_t** data, uint32_t* lens)
+	{
+		std::vector<std::vector<int>> byhome(caches);
+		std::vector<int> moved;
+		for(int i=0;i<n;i++)
+		{
+			int home=HomeOf(addrs[i]);
+			AddSyncHome(home);
+			if(home!=ths->cache_id)
+				byhome[home].push_back(i);
+			else if(ServerWrite(addrs[i],ths->cache_id,data[i],lens[i])>=0)
+				moved.push_back(i);
+		}
+		//as in MultiMiss, send everything before waiting for the replies
+		for(int h=0;h<caches;h++)
+		{
+			if(byhome[h].empty())
+				continue;
+			UaEnterLock(&datasocketlocks[h]);
+			for(int i : byhome[h])
+			{
+				DataPack pack = { addrs[i], MsgWrite, lens[i] };
+				memcpy(pack.buf,data[i],sizeof(pack.buf[0])*lens[i]);
+				SendPack(controlsockets[h],pack);
+			}
+		}
+		for(int h=0;h<caches;h++)
+		{
+			if(byhome[h].empty())
+				continue;
+			//as in MultiMiss, every reply is read even after an error
+			for(int i : byhome[h])
+			{
+				ServerWriteReply reply;
+				if(RcRecvAll(datasockets[h],&reply,sizeof(reply))!=sizeof(reply))
+				{
+					printf("Write receive error %d\n",RcSocketLastError());
+					continue;
+				}
+				if(reply.addr!=addrs[i])
+				{
+					printf("Write return a bad address\n");
+					_BreakPoint;
+					continue;
+				}
+				if(reply.home>=0)
+				{
+					Redirect(addrs[i],reply.home);
+					moved.push_back(i);
+				}
+			}
+			UaLeaveLock(&datasocketlocks[h]);
+		}
+		for(int i : moved)
+			Write(addrs[i],data[i],lens[i]);
+	}
+
 	void DSMDirectoryCache::DSMCacheProtocal::Writeback(uint64_t addr)
 	{
 		//printf("WriteBack %u\n",addr);
-		int target_cache_id=(addr>>DSM_CACHE_BITS) % caches;
+		ths->stat.Inc(StatWritebacks);
+		int target_cache_id=HomeOf(addr);
 		if(target_cache_id==ths->cache_id)
 		{
 			ServerWriteback(addr,ths->cache_id);
 		}
 		else
 		{
-			DataPack pack = { addr, MsgWriteback };
-			RcSend(controlsockets[target_cache_id],&pack,sizeof(pack));
+			DataPack pack = { addr, MsgWriteback, 0 };
+			SendPack(controlsockets[target_cache_id],pack);
 		}
 	}
 
 	void DSMDirectoryCache::DSMCacheProtocal::Write(uint64_t addr, uint32_t* v, uint32_t len)
 	{
-		int target_cache_id=(addr>>DSM_CACHE_BITS) % caches;
-		if(target_cache_id==ths->cache_id)
-		{
-			ServerWrite(addr,ths->cache_id,v,len);
-		}
-		else
+		for(;;)
 		{
+			int target_cache_id=HomeOf(addr);
+			AddSyncHome(target_cache_id);
+			if(target_cache_id==ths->cache_id)
+			{
+				if(ServerWrite(addr,ths->cache_id,v,len)<0)
+					return;
+				continue;
+			}
 			UaEnterLock(&datasocketlocks[target_cache_id]);
 			DataPack pack = { addr, MsgWrite,len };
 			memcpy(pack.buf, v, sizeof(pack.buf[0])*len);
-			RcSend(controlsockets[target_cache_id],&pack,sizeof(pack));
+			SendPack(controlsockets[target_cache_id],pack);
 			ServerWriteReply reply;
-			if(RcRecv(datasockets[target_cache_id],&reply,sizeof(reply))!=sizeof(reply))
+			if(RcRecvAll(datasockets[target_cache_id],&reply,sizeof(reply))!=sizeof(reply))
             {
 				UaLeaveLock(&datasocketlocks[target_cache_id]);
                 printf("Write receive error %d\n",RcSocketLastError());
@@ -304,31 +951,44 @@ namespace Dogee
                 return;
             }
 			UaLeaveLock(&datasocketlocks[target_cache_id]);
+			if(reply.home<0)
+				return;
+			Redirect(addr,reply.home);
 		}
 	}
 
 	SoStatus DSMDirectoryCache::DSMCacheProtocal::WriteMiss(uint64_t addr, uint32_t * v, uint32_t len, CacheBlock* blk)
 	{
-		int target_cache_id=(addr>>DSM_CACHE_BITS) % caches;
-		if(target_cache_id==ths->cache_id)
-		{
-			if(ServerWriteMiss(addr,ths->cache_id,v,1,blk->cache)!=MsgReplyOK)
-				return SoFail;
-		}
-		else
+		for(;;)
 		{
+			int target_cache_id=HomeOf(addr);
+			AddSyncHome(target_cache_id);
+			if(target_cache_id==ths->cache_id)
+			{
+				CacheMessageKind r=ServerWriteMiss(addr,ths->cache_id,v,len,blk->cache);
+				if(r==MsgReplyMoved)
+					continue;
+				if(r!=MsgReplyOK)
+					return SoFail;
+				break;
+			}
 			DataPack pack = { addr, MsgWriteMiss, len };
 			memcpy(pack.buf, v, sizeof(pack.buf[0])*len);
 			UaEnterLock(&datasocketlocks[target_cache_id]);
-			RcSend(controlsockets[target_cache_id],&pack,sizeof(pack));
-			if(RcRecv(datasockets[target_cache_id],&pack,sizeof(pack))!=sizeof(pack))
+			SendPack(controlsockets[target_cache_id],pack);
+			if(!RecvPack(datasockets[target_cache_id],pack))
             {
 				UaLeaveLock(&datasocketlocks[target_cache_id]);
                 printf("Write miss receive error %d\n",RcSocketLastError());
                 return SoFail;
             }
 			UaLeaveLock(&datasocketlocks[target_cache_id]);
-			if(pack.kind!=MsgReplyOK)
+			if(pack.kind==MsgReplyMoved)
+			{
+				Redirect(addr,pack.buf[0]);
+				continue;
+			}
+			if(pack.kind!=MsgReplyOK || pack.len!=DSM_CACHE_BLOCK_SIZE)
 			{
 				return SoFail;
 			}
@@ -338,6 +998,7 @@ namespace Dogee
 				return SoFail;
 			}
 			memcpy(blk->cache,pack.buf,sizeof(blk->cache));
+			break;
 		}
 		blk->key=addr & DSM_CACHE_HIGH_MASK_64;
 		return SoOK;
@@ -346,24 +1007,48 @@ namespace Dogee
 
 	SoStatus DSMDirectoryCache::DSMCacheProtocal::ReadMiss(uint64_t addr,CacheBlock* blk)
 	{
-		int target_cache_id=(addr>>DSM_CACHE_BITS) % caches;
-		if(target_cache_id==ths->cache_id)
-		{
-			if(ServerReadMiss(addr,ths->cache_id,blk->cache)!=MsgReplyOK)
-				return SoFail;
-		}
-		else
+		if(ReadBlock(addr,blk->cache,true)!=SoOK)
+			return SoFail;
+		blk->key=addr;
+		return SoOK;
+	}
+
+	SoStatus DSMDirectoryCache::DSMCacheProtocal::ReadUncached(uint64_t addr, uint32_t* buf)
+	{
+		//the backend is up to date unless the home nodes own the blocks
+		if(!home_owned)
+			return ths->backend->getblock(addr,buf);
+		return ReadBlock(addr,buf,false);
+	}
+
+	SoStatus DSMDirectoryCache::DSMCacheProtocal::ReadBlock(uint64_t addr, uint32_t* buf, bool share)
+	{
+		for(;;)
 		{
-			DataPack pack = { addr, MsgReadMiss };
+			int target_cache_id=HomeOf(addr);
+			if(target_cache_id==ths->cache_id)
+			{
+				CacheMessageKind r=ServerReadMiss(addr,ths->cache_id,buf,share);
+				if(r==MsgReplyMoved)
+					continue;
+				return (r==MsgReplyOK)?SoOK:SoFail;
+			}
+			DataPack pack = { addr, share ? MsgReadMiss : MsgReadUncached, 0 };
 			UaEnterLock(&datasocketlocks[target_cache_id]);
-			RcSend(controlsockets[target_cache_id],&pack,sizeof(pack));
-			if(RcRecv(datasockets[target_cache_id],&pack,sizeof(pack))!=sizeof(pack))
+			SendPack(controlsockets[target_cache_id],pack);
+			if(!RecvPack(datasockets[target_cache_id],pack))
             {
+				UaLeaveLock(&datasocketlocks[target_cache_id]);
                 printf("Read miss receive error %d\n",RcSocketLastError());
                 return SoFail;
             }
 			UaLeaveLock(&datasocketlocks[target_cache_id]);
-			if(pack.kind!=MsgReplyOK)
+			if(pack.kind==MsgReplyMoved)
+			{
+				Redirect(addr,pack.buf[0]);
+				continue;
+			}
+			if(pack.kind!=MsgReplyOK || pack.len!=DSM_CACHE_BLOCK_SIZE)
 				return SoFail;
 			if(pack.addr!=addr)
 			{
@@ -371,10 +1056,9 @@ namespace Dogee
 				_BreakPoint;
 				return SoFail;
 			}
-			memcpy(blk->cache,pack.buf,sizeof(blk->cache));
+			memcpy(buf,pack.buf,sizeof(pack.buf));
+			return SoOK;
 		}
-		blk->key=addr;
-		return SoOK;
 	}
 //end of class DSMCacheProtocal
 
@@ -385,7 +1069,7 @@ namespace Dogee
 CacheBlock* DSMDirectoryCache::getblock(uint64_t k,bool& is_pending)
 {
 	UaEnterLock(&queue_lock);
-
+SWAP:
 	UaEnterReadRWLock(&hash_lock);
 	hash_iterator itr=cache.find(k);
 	if(itr!=cache.end())
@@ -412,7 +1096,7 @@ CacheBlock* DSMDirectoryCache::getblock(uint64_t k,bool& is_pending)
 		int mini=-1;
 		for(int i=0;i<DSM_CACHE_SIZE;i++)
 		{
-			if(block_cache[i].key!=DSM_CACHE_BAD_KEY && block_cache[i].lru<minlru)
+			if(block_cache[i].key!=DSM_CACHE_BAD_KEY && block_cache[i].lru<minlru && !(block_cache[i].wc_words & CACHE_WC_COUNT_MASK) && !block_cache[i].pinned && !block_cache[i].twinned)
 			{
 				minlru=block_cache[i].lru;
 				mini=i;
@@ -421,10 +1105,22 @@ CacheBlock* DSMDirectoryCache::getblock(uint64_t k,bool& is_pending)
 		assert(mini!=-1);
 		//acquire the control over the block and swap it out
 		UaEnterWriteRWLock(&block_cache[mini].lock);
+		//a write may have been combined, or the block pinned or twinned before we got the lock
+		if((block_cache[mini].wc_words & CACHE_WC_COUNT_MASK) || block_cache[mini].pinned || block_cache[mini].twinned)
+		{
+			UaLeaveWriteRWLock(&block_cache[mini].lock);
+			goto SWAP;
+		}
 
 		uint64_t oldkey=block_cache[mini].key;
+		stat.Inc(StatEvictions);
 		block_cache[mini].key=DSM_CACHE_BAD_KEY;
+		block_cache[mini].version++;
 		block_cache[mini].lru=0xffffffff;
+		block_cache[mini].prefetched=false;
+		block_cache[mini].invalid=false;
+		block_cache[mini].unread_renews=0;
+		block_cache[mini].pinned=false;
 		UaEnterWriteRWLock(&hash_lock);
 		cache.erase(oldkey);
 		cache[k]=&block_cache[mini];
@@ -434,7 +1130,8 @@ CacheBlock* DSMDirectoryCache::getblock(uint64_t k,bool& is_pending)
 		UaLeaveLock(&queue_lock);
 
 		//we don't release the block's lock here. we should release it when the block is finally ready
-		protocal->Writeback(oldkey);
+		if(!DSM_IS_READONLY_KEY(oldkey>>32))
+			protocal->Writeback(oldkey);
 
 		ret=&block_cache[mini];
 	}
@@ -442,6 +1139,10 @@ CacheBlock* DSMDirectoryCache::getblock(uint64_t k,bool& is_pending)
 	{
 		ret=block_queue.front();
 		block_queue.pop();
+		ret->invalid=false;
+		ret->unread_renews=0;
+		ret->pinned=false;
+		ret->version++;
 		UaEnterWriteRWLock(&hash_lock);
 		cache[k]=ret;
 		UaLeaveWriteRWLock(&hash_lock);
@@ -449,7 +1150,187 @@ CacheBlock* DSMDirectoryCache::getblock(uint64_t k,bool& is_pending)
 		UaLeaveLock(&queue_lock);
 	}
 
-	return ret;
+	return ret;
+}
+
+/*
+The per-thread state of the stride prefetcher. Strides are in blocks.
+"front" is the furthest block already requested on the current stream.
+Every PREFETCH_WINDOW prefetches the depth is doubled if most of the
+prefetched blocks were read, or halved if most of them were not.
+*/
+struct StreamDetector
+{
+	uint64_t last;
+	int64_t stride;
+	uint64_t front;
+	int depth;
+	int issued;
+	int useful;
+};
+static THREAD_LOCAL StreamDetector stream_detector = { DSM_CACHE_BAD_KEY, 0, DSM_CACHE_BAD_KEY, 0, 0, 0 };
+#define PREFETCH_MAX_STRIDE 64
+#define PREFETCH_WINDOW 32
+
+void DSMDirectoryCache::stream_access(uint64_t k, bool prefetched_hit)
+{
+	if (!prefetcher)
+		return;
+	StreamDetector& d = stream_detector;
+	if (prefetched_hit)
+		d.useful++;
+	//strides are only detected within an object
+	int64_t stride = ((k >> 32) == (d.last >> 32)) ? ((int64_t)k - (int64_t)d.last) / DSM_CACHE_BLOCK_SIZE : 0;
+	d.last = k;
+	if (stride == 0 || stride > PREFETCH_MAX_STRIDE || stride < -PREFETCH_MAX_STRIDE)
+	{
+		d.stride = 0;
+		return;
+	}
+	if (stride != d.stride)
+	{
+		//one more access with the same stride is needed to confirm the stream
+		d.stride = stride;
+		d.front = k;
+		return;
+	}
+	if (d.depth == 0)
+		d.depth = 2 < DogeeEnv::CacheConfig::prefetch_max_depth ? 2 : DogeeEnv::CacheConfig::prefetch_max_depth;
+
+	const int64_t step = stride * DSM_CACHE_BLOCK_SIZE;
+	int64_t ahead = ((int64_t)d.front - (int64_t)k) / step;
+	if (ahead < 0 || ahead > d.depth)
+		ahead = 0;
+	for (int64_t i = ahead + 1; i <= d.depth; i++)
+	{
+		uint64_t next = k + i * step;
+		if ((next >> 32) != (k >> 32))
+			break;
+		//do not let the requests pile up if the home nodes can not keep up
+		if (prefetch_inflight >= DogeeEnv::CacheConfig::prefetch_max_depth * DogeeEnv::CacheConfig::prefetch_threads * 2)
+			break;
+		prefetch_inflight++;
+		auto task = [this, next](){ prefetch(next); };
+		prefetcher->submit2(task);
+		d.front = next;
+		d.issued++;
+	}
+
+	if (d.issued >= PREFETCH_WINDOW)
+	{
+		if (d.useful * 4 >= d.issued * 3)
+			d.depth = d.depth * 2 < DogeeEnv::CacheConfig::prefetch_max_depth ? d.depth * 2 : DogeeEnv::CacheConfig::prefetch_max_depth;
+		else if (d.useful * 2 < d.issued)
+			d.depth = d.depth / 2 > 1 ? d.depth / 2 : 1;
+		d.issued = 0;
+		d.useful = 0;
+	}
+}
+
+void DSMDirectoryCache::dropblock(uint64_t k, CacheBlock* blk)
+{
+	UaEnterWriteRWLock(&hash_lock);
+	hash_iterator itr = cache.find(k);
+	if (itr != cache.end() && itr->second == blk)
+		cache.erase(itr);
+	UaLeaveWriteRWLock(&hash_lock);
+	twindrop(blk);
+	wcreset(blk);
+	blk->key = DSM_CACHE_BAD_KEY;
+	blk->version++;
+	blk->pinned = false;
+	UaLeaveWriteRWLock(&blk->lock);
+	UaEnterLock(&queue_lock);
+	block_queue.push(blk);
+	UaLeaveLock(&queue_lock);
+	//the home may have registered this cache as a sharer before failing
+	if (!DSM_IS_READONLY_KEY(k >> 32))
+		protocal->Writeback(k);
+}
+
+void DSMDirectoryCache::refetch(uint64_t k, CacheBlock* blk)
+{
+	UaEnterWriteRWLock(&blk->lock);
+	//another thread may have fetched it again
+	if (blk->key != k || !blk->invalid)
+	{
+		UaLeaveWriteRWLock(&blk->lock);
+		return;
+	}
+	blk->invalid = false;
+	blk->unread_renews = 0;
+	//keep the words not yet sent by the write-combining buffers or by the releases
+	uint32_t dirty = 0;
+	uint32_t saved[DSM_CACHE_BLOCK_SIZE];
+	for (uint32_t i = 0; i < DSM_CACHE_BLOCK_SIZE; i++)
+	{
+		if (blk->wc_pending[i] & CACHE_WC_COUNT_MASK)
+			dirty |= 1u << i;
+	}
+	if (blk->twinned)
+	{
+		std::lock_guard<std::mutex> guard(twin_lock);
+		auto itr = twins.find(k);
+		if (itr != twins.end())
+		{
+			for (uint32_t i = 0; i < DSM_CACHE_BLOCK_SIZE; i++)
+			{
+				if (blk->cache[i] != itr->second.data[i])
+					dirty |= 1u << i;
+			}
+		}
+	}
+	if (dirty)
+		memcpy(saved, blk->cache, sizeof(saved));
+	if (fetchblock(k, blk) != SoOK)
+	{
+		dropblock(k, blk);
+		return;
+	}
+	//the fetched words are the new base of the diff
+	if (blk->twinned)
+	{
+		std::lock_guard<std::mutex> guard(twin_lock);
+		auto itr = twins.find(k);
+		if (itr != twins.end())
+			memcpy(itr->second.data, blk->cache, sizeof(itr->second.data));
+	}
+	for (uint32_t i = 0; dirty; i++, dirty >>= 1)
+	{
+		if (dirty & 1)
+			blk->cache[i] = saved[i];
+	}
+	blk->lru = CacheClock();
+	UaLeaveWriteRWLock(&blk->lock);
+}
+
+void DSMDirectoryCache::prefetch(uint64_t k)
+{
+	DogeeEnv::InitCurrentThread();
+	UaEnterReadRWLock(&hash_lock);
+	bool found = (cache.find(k) != cache.end());
+	UaLeaveReadRWLock(&hash_lock);
+	if (!found)
+	{
+		bool is_pending;
+		CacheBlock* blk = getblock(k, is_pending);
+		if (!is_pending)
+		{
+			if (fetchblock(k, blk) == SoOK)
+			{
+				blk->lru = CacheClock();
+				blk->prefetched = true;
+				stat.Inc(StatPrefetches);
+				UaLeaveWriteRWLock(&blk->lock);
+			}
+			else
+			{
+				//the stream ran out of the object. Give the block back
+				dropblock(k, blk);
+			}
+		}
+	}
+	prefetch_inflight--;
 }
 
 SoStatus DSMDirectoryCache::put(ObjectKey okey, FieldKey fldid, uint64_t v)
@@ -467,12 +1348,266 @@ SoStatus DSMDirectoryCache::putblockdata(LongKey k, uint32_t len, uint32_t* buf)
 	return doput(k, buf, len);
 }
 
+SoStatus DSMDirectoryCache::fetchblock(uint64_t k, CacheBlock* blk)
+{
+	//the home node does not track the blocks of read-only objects
+	if (DSM_IS_READONLY_KEY(k >> 32))
+	{
+		if (backend->getblock(k, blk->cache) != SoOK)
+			return SoFail;
+		blk->key = k;
+		return SoOK;
+	}
+	return protocal->ReadMiss(k, blk);
+}
+
+SoStatus DSMDirectoryCache::putreadonly(LongKey addr, uint32_t* v, uint32_t len)
+{
+	//initializing a read-only object. Write to the backend and keep the local copy (if any) up to date
+	SoStatus ret = backend->putchunk(addr >> 32, addr & 0xffffffff, len, v);
+	CacheBlock* blk = find_block(addr & DSM_CACHE_HIGH_MASK_64);
+	if (blk)
+	{
+		memcpy(&blk->cache[addr & DSM_CACHE_LOW_MASK_64], v, sizeof(blk->cache[0])*len);
+		UaLeaveReadRWLock(&blk->lock);
+	}
+	return ret;
+}
+
+struct WriteCombiner
+{
+	//the instance_id of the cache the buffer belongs to
+	uint32_t owner;
+	CacheBlock* blk;
+	//the generation of blk when the first word was added
+	uint32_t gen;
+	uint64_t addr;
+	uint32_t len;
+	uint32_t data[DSM_CACHE_BLOCK_SIZE];
+};
+static THREAD_LOCAL WriteCombiner write_combiner = { 0, NULL, 0, 0, 0 };
+
+//count down a pending count by n, unless the block has been given back since gen
+static inline void WcCountDown(std::atomic<uint32_t>& cnt, uint32_t gen, uint32_t n)
+{
+	uint32_t v = cnt;
+	while ((v & ~CACHE_WC_COUNT_MASK) == gen && !cnt.compare_exchange_weak(v, v - n))
+		;
+}
+
+void DSMDirectoryCache::wcflush()
+{
+	WriteCombiner& wc = write_combiner;
+	if (!wc.len || wc.owner != instance_id)
+		return;
+	protocal->Write(wc.addr, wc.data, wc.len);
+	//no lock of the block is held here, so it may be given back meanwhile. The generation tells
+	uint32_t offset = wc.addr & DSM_CACHE_LOW_MASK_64;
+	for (uint32_t i = 0; i < wc.len; i++)
+		WcCountDown(wc.blk->wc_pending[offset + i], wc.gen, 1);
+	WcCountDown(wc.blk->wc_words, wc.gen, wc.len);
+	wc.len = 0;
+}
+
+void DSMDirectoryCache::wccombine(uint64_t addr, uint32_t* v, uint32_t len, CacheBlock* blk)
+{
+	WriteCombiner& wc = write_combiner;
+	uint32_t gen = blk->wc_words & ~CACHE_WC_COUNT_MASK;
+	if (wc.len && (wc.owner != instance_id || wc.blk != blk || wc.gen != gen || wc.addr + wc.len != addr))
+		wcflush();
+	if (!wc.len)
+	{
+		wc.owner = instance_id;
+		wc.blk = blk;
+		wc.gen = gen;
+		wc.addr = addr;
+	}
+	uint32_t offset = addr & DSM_CACHE_LOW_MASK_64;
+	memcpy(wc.data + wc.len, v, sizeof(v[0])*len);
+	wc.len += len;
+	//count the words before writing them, so that a renew does not overwrite them (see renewblock)
+	for (uint32_t i = 0; i < len; i++)
+		blk->wc_pending[offset + i]++;
+	blk->wc_words += len;
+	memcpy(&blk->cache[offset], v, sizeof(blk->cache[0])*len);
+	if (offset + len == DSM_CACHE_BLOCK_SIZE)
+		wcflush();
+}
+
+void DSMDirectoryCache::wcreset(CacheBlock* blk)
+{
+	//the buffers still holding words of the old generation fail the check in WcCountDown
+	uint32_t gen = (blk->wc_words & ~CACHE_WC_COUNT_MASK) + CACHE_WC_COUNT_MASK + 1;
+	for (uint32_t i = 0; i < DSM_CACHE_BLOCK_SIZE; i++)
+		blk->wc_pending[i] = gen;
+	blk->wc_words = gen;
+}
+
+void DSMDirectoryCache::mwwrite(uint64_t addr, uint32_t* v, uint32_t len, CacheBlock* blk)
+{
+	if (!blk->twinned)
+	{
+		std::lock_guard<std::mutex> guard(twin_lock);
+		if (!blk->twinned)
+		{
+			Twin& t = twins[blk->key];
+			t.blk = blk;
+			memcpy(t.data, blk->cache, sizeof(t.data));
+			blk->twinned = true;
+			twin_count++;
+		}
+	}
+	memcpy(&blk->cache[addr & DSM_CACHE_LOW_MASK_64], v, sizeof(blk->cache[0])*len);
+}
+
+void DSMDirectoryCache::renewblock(CacheBlock* blk, uint32_t offset, uint32_t* v, uint32_t len, bool remote)
+{
+	if (!DogeeEnv::CacheConfig::multiple_writers)
+	{
+		//the count is checked for each word, as a write hit may combine a word meanwhile
+		for (uint32_t i = 0; i < len; i++)
+		{
+			if (!(blk->wc_pending[offset + i] & CACHE_WC_COUNT_MASK))
+				blk->cache[offset + i] = v[i];
+		}
+		return;
+	}
+	//under twin_lock, so that a twin being made gets the update
+	std::lock_guard<std::mutex> guard(twin_lock);
+	uint32_t* twin = NULL;
+	if (blk->twinned)
+	{
+		auto itr = twins.find(blk->key);
+		if (itr != twins.end())
+			twin = itr->second.data;
+	}
+	for (uint32_t i = offset; i < offset + len; i++)
+	{
+		//a word changed here is still sent by the next mwflush, so the diff is kept
+		if (!remote || !twin || blk->cache[i] == twin[i])
+			blk->cache[i] = v[i - offset];
+		if (twin)
+			twin[i] = v[i - offset];
+	}
+}
+
+void DSMDirectoryCache::twindrop(CacheBlock* blk)
+{
+	if (!blk->twinned)
+		return;
+	std::lock_guard<std::mutex> guard(twin_lock);
+	auto itr = twins.find(blk->key);
+	if (itr != twins.end() && itr->second.blk == blk)
+	{
+		twins.erase(itr);
+		twin_count--;
+	}
+	blk->twinned = false;
+}
+
+void DSMDirectoryCache::mwflush()
+{
+	if (!DogeeEnv::CacheConfig::multiple_writers)
+		return;
+	/*
+	The twins are shared by the threads of the node. A thread finding no
+	twins may still have words in a flush of another thread, so it waits
+	until that flush and its Sync are done
+	*/
+	std::lock_guard<std::mutex> flush_guard(mw_flush_lock);
+	if (!twin_count)
+		return;
+	std::vector<uint64_t> keys;
+	{
+		std::lock_guard<std::mutex> guard(twin_lock);
+		for (auto& t : twins)
+			keys.push_back(t.first);
+	}
+	//the changed words of each block are sent as runs, all the runs of a batch pipelined
+	uint64_t addrs[CACHE_BATCH_BLOCKS];
+	uint32_t* data[CACHE_BATCH_BLOCKS];
+	uint32_t lens[CACHE_BATCH_BLOCKS];
+	uint32_t words[CACHE_BATCH_BLOCKS][DSM_CACHE_BLOCK_SIZE];
+	int n = 0, used = 0;
+	for (uint64_t k : keys)
+	{
+		//a block has at most DSM_CACHE_BLOCK_SIZE/2 runs
+		if (used == CACHE_BATCH_BLOCKS || n + DSM_CACHE_BLOCK_SIZE / 2 > CACHE_BATCH_BLOCKS)
+		{
+			protocal->MultiWrite(n, addrs, data, lens);
+			n = 0;
+			used = 0;
+		}
+		CacheBlock* blk;
+		{
+			std::lock_guard<std::mutex> guard(twin_lock);
+			auto itr = twins.find(k);
+			if (itr == twins.end())
+				continue;
+			blk = itr->second.blk;
+		}
+		//no thread writes to the block while it is compared
+		UaEnterWriteRWLock(&blk->lock);
+		uint32_t twin[DSM_CACHE_BLOCK_SIZE];
+		bool found = false;
+		{
+			std::lock_guard<std::mutex> guard(twin_lock);
+			auto itr = twins.find(k);
+			if (itr != twins.end() && itr->second.blk == blk)
+			{
+				memcpy(twin, itr->second.data, sizeof(twin));
+				twins.erase(itr);
+				twin_count--;
+				found = true;
+			}
+		}
+		if (found && blk->key == k)
+		{
+			blk->twinned = false;
+			memcpy(words[used], blk->cache, sizeof(words[used]));
+			uint32_t i = 0;
+			while (i < DSM_CACHE_BLOCK_SIZE)
+			{
+				if (words[used][i] == twin[i])
+				{
+					i++;
+					continue;
+				}
+				uint32_t start = i;
+				while (i < DSM_CACHE_BLOCK_SIZE && words[used][i] != twin[i])
+					i++;
+				addrs[n] = k + start;
+				data[n] = words[used] + start;
+				lens[n] = i - start;
+				stat.Inc(StatDiffWords, i - start);
+				n++;
+			}
+			used++;
+		}
+		UaLeaveWriteRWLock(&blk->lock);
+	}
+	if (n)
+		protocal->MultiWrite(n, addrs, data, lens);
+	//the words of the other threads are only visible after the homes have sent their renews and invalidations
+	protocal->Sync();
+}
+
 SoStatus DSMDirectoryCache::doput(LongKey addr,uint32_t* v,uint32_t len)
 {
-#ifdef BD_DSM_STAT
-	writes++;
-#endif
+	stat.Inc(StatWrites);
+	if (DSM_IS_READONLY_KEY(addr >> 32))
+		return putreadonly(addr, v, len);
+	if (dsm_streaming)
+	{
+		wcflush();
+		return streamput(addr, len, v);
+	}
 	uint64_t k = addr & DSM_CACHE_HIGH_MASK_64;
+	bool multiple_writers = DogeeEnv::CacheConfig::multiple_writers;
+	bool write_combining = DogeeEnv::CacheConfig::write_combining;
+	//too many blocks would be kept from being swapped out
+	if (multiple_writers && twin_count >= CACHE_MAX_TWINS)
+		mwflush();
 	
 	UaEnterReadRWLock(&hash_lock);
 	hash_iterator itr=cache.find(k);
@@ -488,13 +1623,20 @@ SoStatus DSMDirectoryCache::doput(LongKey addr,uint32_t* v,uint32_t len)
 			UaLeaveReadRWLock(&foundblock->lock);
 			goto MISS;
 		}
-#ifdef BD_DSM_STAT
-		whit++;
-#endif
+		stat.Inc(StatWriteHits);
 		foundblock->lru=CacheClock();
+		if (foundblock->unread_renews)
+			foundblock->unread_renews = 0;
 		//foundblock->cache[fldid & DSM_CACHE_LOW_MASK]=v;
-		memcpy(&foundblock->cache[addr & DSM_CACHE_LOW_MASK_64], v, sizeof(foundblock->cache[0])*len);
-		protocal->Write(addr,v,len);
+		if (multiple_writers)
+			mwwrite(addr, v, len, foundblock);
+		else if (write_combining)
+			wccombine(addr, v, len, foundblock);
+		else
+		{
+			memcpy(&foundblock->cache[addr & DSM_CACHE_LOW_MASK_64], v, sizeof(foundblock->cache[0])*len);
+			protocal->Write(addr, v, len);
+		}
 		UaLeaveReadRWLock(&foundblock->lock);
 		
 		return SoOK;
@@ -512,14 +1654,24 @@ MISS:
 		}
 		blk->lru=CacheClock();
 		//blk->cache[fldid & DSM_CACHE_LOW_MASK]=v;
-		memcpy(&blk->cache[addr & DSM_CACHE_LOW_MASK_64], v, sizeof(blk->cache[0])*len);
-		protocal->Write(addr, v, len);
+		if (multiple_writers)
+			mwwrite(addr, v, len, blk);
+		else if (write_combining)
+			wccombine(addr, v, len, blk);
+		else
+		{
+			memcpy(&blk->cache[addr & DSM_CACHE_LOW_MASK_64], v, sizeof(blk->cache[0])*len);
+			protocal->Write(addr, v, len);
+		}
 		UaLeaveReadRWLock(&blk->lock);
 		
 		return SoOK;
 	}
 	else
 	{
+		stat.Miss(addr >> 32);
+		//keep the writes to the home in program order
+		wcflush();
 		protocal->WriteMiss(addr, v, len, blk);
 		blk->lru=CacheClock();
 		if(blk->key!=k)
@@ -534,13 +1686,99 @@ MISS:
 	}
 }
 
+/*
+The per-thread L0 cache, a small direct-mapped table of the blocks this
+thread has read lately. An entry holds the version of the block when it
+was recorded, and is valid as long as the version is unchanged. Hits take
+no lock, so the version is checked again after the data is read.
+*/
+struct L0Entry
+{
+	uint64_t key;
+	CacheBlock* blk;
+	uint32_t version;
+	uint32_t hits;
+};
+struct L0Cache
+{
+	//the instance_id of the cache the entries belong to
+	uint32_t owner;
+	L0Entry entries[CACHE_L0_SIZE];
+};
+static THREAD_LOCAL L0Cache l0_cache;
+#define L0_INDEX(k) ((((k) >> DSM_CACHE_BITS) ^ ((k) >> 32)) & (CACHE_L0_SIZE - 1))
+//the lru of a block is refreshed every L0_LRU_HITS hits in the L0 cache
+#define L0_LRU_HITS 64
+
+static std::atomic<uint32_t> cache_instances = ATOMIC_VAR_INIT(0);
+
+uint32_t DSMDirectoryCache::NewInstanceId()
+{
+	return ++cache_instances;
+}
+
+bool DSMDirectoryCache::l0get(uint64_t k, std::function<void(CacheBlock*)>& func)
+{
+	L0Cache& l0 = l0_cache;
+	if (l0.owner != instance_id)
+	{
+		l0.owner = instance_id;
+		for (int i = 0; i < CACHE_L0_SIZE; i++)
+			l0.entries[i].key = DSM_CACHE_BAD_KEY;
+		return false;
+	}
+	L0Entry& e = l0.entries[L0_INDEX(k)];
+	if (e.key != k)
+		return false;
+	CacheBlock* blk = e.blk;
+	if (blk->version.load(std::memory_order_acquire) != e.version)
+	{
+		e.key = DSM_CACHE_BAD_KEY;
+		return false;
+	}
+	func(blk);
+	//the block may have been swapped out while we were reading it
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (blk->version.load(std::memory_order_relaxed) != e.version)
+	{
+		e.key = DSM_CACHE_BAD_KEY;
+		return false;
+	}
+	if (++e.hits % L0_LRU_HITS == 0)
+		blk->lru = CacheClock();
+	if (blk->unread_renews)
+		blk->unread_renews = 0;
+	return true;
+}
+
+void DSMDirectoryCache::l0put(uint64_t k, CacheBlock* blk, uint32_t version)
+{
+	L0Cache& l0 = l0_cache;
+	if (l0.owner != instance_id)
+		return;
+	L0Entry& e = l0.entries[L0_INDEX(k)];
+	e.key = k;
+	e.blk = blk;
+	e.version = version;
+	e.hits = 0;
+}
+
 void DSMDirectoryCache::doget(LongKey k, std::function<void(CacheBlock*)> func)
 {
-#ifdef BD_DSM_STAT
-	reads++;
-#endif
+	stat.Inc(StatReads);
 	k = k & DSM_CACHE_HIGH_MASK_64;
+	if (l0get(k, func))
+	{
+		stat.Inc(StatReadHits);
+		return;
+	}
+	if (dsm_streaming)
+	{
+		streamget(k, func);
+		return;
+	}
 
+LOOKUP:
 	UaEnterReadRWLock(&hash_lock);
 	hash_iterator itr = cache.find(k);
 	bool found = (itr != cache.end());
@@ -555,13 +1793,25 @@ void DSMDirectoryCache::doget(LongKey k, std::function<void(CacheBlock*)> func)
 			UaLeaveReadRWLock(&foundblock->lock);
 			goto MISS;
 		}
-#ifdef BD_DSM_STAT
-		rhit++;
-#endif
+		//read the version before the flag, as MarkInvalid sets them in the other order
+		uint32_t version = foundblock->version;
+		if (foundblock->invalid)
+		{
+			UaLeaveReadRWLock(&foundblock->lock);
+			refetch(k, foundblock);
+			goto LOOKUP;
+		}
+		stat.Inc(StatReadHits);
 		foundblock->lru = CacheClock();
+		if (foundblock->unread_renews)
+			foundblock->unread_renews = 0;
 		func(foundblock);
 		//ret = foundblock->cache[fldid & DSM_CACHE_LOW_MASK];
+		bool prefetched = foundblock->prefetched && foundblock->prefetched.exchange(false);
 		UaLeaveReadRWLock(&foundblock->lock);
+		l0put(k, foundblock, version);
+		if (prefetched)
+			stream_access(k, true);
 		return ;
 	}
 MISS:
@@ -575,16 +1825,27 @@ MISS:
 			UaLeaveReadRWLock(&blk->lock);
 			goto MISS;
 		}
+		uint32_t version = blk->version;
+		if (blk->invalid)
+		{
+			UaLeaveReadRWLock(&blk->lock);
+			refetch(k, blk);
+			goto LOOKUP;
+		}
 		blk->lru = CacheClock();
 		func(blk);
 		//ret = blk->cache[fldid & DSM_CACHE_LOW_MASK];
+		bool prefetched = blk->prefetched && blk->prefetched.exchange(false);
 		UaLeaveReadRWLock(&blk->lock);
-
+		l0put(k, blk, version);
+		if (prefetched)
+			stream_access(k, true);
 		return ;
 	}
 	else
 	{
-		protocal->ReadMiss(k, blk);
+		stat.Miss(k >> 32);
+		fetchblock(k, blk);
 		blk->lru = CacheClock();
 		if (blk->key != k)
 		{
@@ -593,8 +1854,12 @@ MISS:
 		}
 		func(blk);
 		//ret = blk->cache[fldid & DSM_CACHE_LOW_MASK];
+		uint32_t version = blk->version;
+		bool valid = !blk->invalid;
 		UaLeaveWriteRWLock(&blk->lock);
-
+		if (valid)
+			l0put(k, blk, version);
+		stream_access(k, false);
 		return;
 	}
 }
@@ -634,9 +1899,134 @@ CacheBlock* DSMDirectoryCache::find_block(uint64_t k)
 	return NULL;
 }
 
-SoStatus DSMDirectoryCache::putchunk(ObjectKey okey, FieldKey fldid, uint32_t len, uint32_t* v)
+void DSMDirectoryCache::streamget(uint64_t k, std::function<void(CacheBlock*)>& func)
+{
+	CacheBlock* blk = find_block(k);
+	if (blk)
+	{
+		if (!blk->invalid)
+		{
+			stat.Inc(StatReadHits);
+			func(blk);
+			UaLeaveReadRWLock(&blk->lock);
+			return;
+		}
+		UaLeaveReadRWLock(&blk->lock);
+	}
+	stat.Miss(k >> 32);
+	CacheBlock tmp;
+	SoStatus ret = DSM_IS_READONLY_KEY(k >> 32) ? backend->getblock(k, tmp.cache) : protocal->ReadUncached(k, tmp.cache);
+	if (ret != SoOK)
+	{
+		printf("Streaming read error\n");
+		_BreakPoint;
+		return;
+	}
+	func(&tmp);
+}
+
+SoStatus DSMDirectoryCache::streamput(uint64_t k, uint32_t len, uint32_t* v)
+{
+	uint64_t addrs[CACHE_BATCH_BLOCKS];
+	uint32_t* data[CACHE_BATCH_BLOCKS];
+	uint32_t lens[CACHE_BATCH_BLOCKS];
+	int n = 0;
+	uint32_t idx = 0;
+	while (idx < len)
+	{
+		uint64_t cur = k + idx;
+		uint32_t plen = DSM_CACHE_BLOCK_SIZE - (uint32_t)(cur & DSM_CACHE_LOW_MASK_64);
+		if (plen > len - idx)
+			plen = len - idx;
+		CacheBlock* blk = find_block(cur & DSM_CACHE_HIGH_MASK_64);
+		if (blk)
+		{
+			//keep the cached copy (and its twin) up to date
+			stat.Inc(StatWriteHits);
+			renewblock(blk, cur & DSM_CACHE_LOW_MASK_64, v + idx, plen, false);
+			protocal->Write(cur, v + idx, plen);
+			UaLeaveReadRWLock(&blk->lock);
+		}
+		else
+		{
+			stat.Miss(cur >> 32);
+			addrs[n] = cur;
+			data[n] = v + idx;
+			lens[n] = plen;
+			n++;
+			if (n == CACHE_BATCH_BLOCKS)
+			{
+				protocal->MultiWrite(n, addrs, data, lens);
+				n = 0;
+			}
+		}
+		idx += plen;
+	}
+	if (n)
+		protocal->MultiWrite(n, addrs, data, lens);
+	return SoOK;
+}
+
+void DSMDirectoryCache::batchmiss(uint64_t k, uint32_t len, uint32_t* wdata, bool* written)
+{
+	uint64_t addrs[CACHE_BATCH_BLOCKS];
+	uint32_t* wptrs[CACHE_BATCH_BLOCKS];
+	CacheBlock* blks[CACHE_BATCH_BLOCKS];
+	SoStatus status[CACHE_BATCH_BLOCKS];
+	int index[CACHE_BATCH_BLOCKS];
+	int n = 0;
+	uint64_t first = k & DSM_CACHE_HIGH_MASK_64;
+	int nblocks = (int)((k + len - 1 - first) / DSM_CACHE_BLOCK_SIZE) + 1;
+	assert(nblocks <= CACHE_BATCH_BLOCKS);
+	for (int j = 0; j < nblocks; j++)
+	{
+		uint64_t b = first + j * DSM_CACHE_BLOCK_SIZE;
+		uint32_t* w = NULL;
+		if (written)
+			written[j] = false;
+		if (wdata)
+		{
+			//only the blocks fully covered by the written range
+			if (b < k || b + DSM_CACHE_BLOCK_SIZE > k + len)
+				continue;
+			w = wdata + (b - k);
+		}
+		UaEnterReadRWLock(&hash_lock);
+		bool found = (cache.find(b) != cache.end());
+		UaLeaveReadRWLock(&hash_lock);
+		if (found)
+			continue;
+		bool is_pending;
+		CacheBlock* blk = getblock(b, is_pending);
+		if (is_pending) //someone else is fetching it
+			continue;
+		addrs[n] = b;
+		wptrs[n] = w;
+		blks[n] = blk;
+		index[n] = j;
+		n++;
+	}
+	if (n == 0)
+		return;
+	protocal->MultiMiss(n, addrs, wptrs, blks, status);
+	for (int i = 0; i < n; i++)
+	{
+		if (status[i] == SoOK)
+		{
+			stat.Inc(StatBatchFetches);
+			stat.Miss(addrs[i] >> 32);
+			blks[i]->lru = CacheClock();
+			if (wptrs[i])
+				written[index[i]] = true;
+			UaLeaveWriteRWLock(&blks[i]->lock);
+		}
+		else
+			dropblock(addrs[i], blks[i]);
+	}
+}
+
+SoStatus DSMDirectoryCache::putrange(uint64_t k, uint32_t len, uint32_t* v, bool* written)
 {
-	uint64_t k=MAKE64(okey,fldid);
 	uint64_t k_start,k_end,k_tail;
 
 	k_tail=k+len;
@@ -646,8 +2036,7 @@ SoStatus DSMDirectoryCache::putchunk(ObjectKey okey, FieldKey fldid, uint32_t le
 		k_start=k;
 
 	k_end= k_tail & DSM_CACHE_HIGH_MASK_64;
-	SoStatus ret;
-	CacheBlock* foundblock=NULL;
+	SoStatus ret=SoOK;
 	
 	uint32_t idx=0;
 	uint64_t i;
@@ -664,8 +2053,12 @@ SoStatus DSMDirectoryCache::putchunk(ObjectKey okey, FieldKey fldid, uint32_t le
 
 	for(i=k_start;i<k_end;i+=DSM_CACHE_BLOCK_SIZE)
 	{
-		if (putblockdata(i, DSM_CACHE_BLOCK_SIZE, v + idx) != SoOK)
-			ret = SoFail;
+		//skip the blocks already written by batchmiss
+		if (!written || !written[(i - (k & DSM_CACHE_HIGH_MASK_64)) / DSM_CACHE_BLOCK_SIZE])
+		{
+			if (putblockdata(i, DSM_CACHE_BLOCK_SIZE, v + idx) != SoOK)
+				ret = SoFail;
+		}
 		idx += DSM_CACHE_BLOCK_SIZE;
 	}
 	if(idx<len)
@@ -677,20 +2070,8 @@ SoStatus DSMDirectoryCache::putchunk(ObjectKey okey, FieldKey fldid, uint32_t le
 	return ret;
 }
 
-SoStatus DSMDirectoryCache::putchunk(ObjectKey okey,FieldKey fldid,uint32_t len,uint64_t* v)
-{
-	return putchunk(okey, fldid, len * 2, (uint32_t*)v);
-}
-
-
-SoStatus DSMDirectoryCache::getchunk(ObjectKey okey, FieldKey fldid, uint32_t len, uint64_t* v)
-{
-	return getchunk(okey, fldid, len * 2, (uint32_t*)v);
-}
-
-SoStatus DSMDirectoryCache::getchunk(ObjectKey okey, FieldKey fldid, uint32_t len, uint32_t* v)
+SoStatus DSMDirectoryCache::getrange(uint64_t k, uint32_t len, uint32_t* v)
 {
-	uint64_t k = MAKE64(okey, fldid);
 	uint64_t k_start, k_end, k_tail;
 
 	k_tail = k + len;
@@ -701,7 +2082,6 @@ SoStatus DSMDirectoryCache::getchunk(ObjectKey okey, FieldKey fldid, uint32_t le
 
 	k_end = k_tail & DSM_CACHE_HIGH_MASK_64;
 	SoStatus ret=SoOK;
-	CacheBlock* foundblock = NULL;
 
 	uint32_t idx = 0;
 	uint64_t i;
@@ -727,5 +2107,138 @@ SoStatus DSMDirectoryCache::getchunk(ObjectKey okey, FieldKey fldid, uint32_t le
 	return ret;
 }
 
+/*
+Large ranges are split into windows of CACHE_BATCH_BLOCKS blocks (ending at
+block boundaries). The missing blocks of each window are fetched by one
+pipelined batch of requests to each home before the window is copied.
+*/
+SoStatus DSMDirectoryCache::putchunk(ObjectKey okey, FieldKey fldid, uint32_t len, uint32_t* v)
+{
+	uint64_t k = MAKE64(okey, fldid);
+	wcflush();
+	if (dsm_streaming && !DSM_IS_READONLY_KEY(okey))
+	{
+		stat.Inc(StatWrites);
+		return streamput(k, len, v);
+	}
+	if (len <= DSM_CACHE_BLOCK_SIZE || DSM_IS_READONLY_KEY(okey))
+		return putrange(k, len, v, NULL);
+	SoStatus ret = SoOK;
+	bool written[CACHE_BATCH_BLOCKS];
+	uint32_t idx = 0;
+	while (idx < len)
+	{
+		uint64_t cur = k + idx;
+		uint32_t wlen = CACHE_BATCH_BLOCKS * DSM_CACHE_BLOCK_SIZE - (uint32_t)(cur & DSM_CACHE_LOW_MASK_64);
+		if (wlen > len - idx)
+			wlen = len - idx;
+		batchmiss(cur, wlen, v + idx, written);
+		if (putrange(cur, wlen, v + idx, written) != SoOK)
+			ret = SoFail;
+		idx += wlen;
+	}
+	return ret;
+}
+
+SoStatus DSMDirectoryCache::putchunk(ObjectKey okey,FieldKey fldid,uint32_t len,uint64_t* v)
+{
+	return putchunk(okey, fldid, len * 2, (uint32_t*)v);
+}
+
+
+SoStatus DSMDirectoryCache::getchunk(ObjectKey okey, FieldKey fldid, uint32_t len, uint64_t* v)
+{
+	return getchunk(okey, fldid, len * 2, (uint32_t*)v);
+}
+
+SoStatus DSMDirectoryCache::getchunk(ObjectKey okey, FieldKey fldid, uint32_t len, uint32_t* v)
+{
+	uint64_t k = MAKE64(okey, fldid);
+	//the backend is up to date unless the home nodes own the blocks
+	if (dsm_streaming && (!protocal->IsHomeOwned() || DSM_IS_READONLY_KEY(okey)))
+	{
+		stat.Inc(StatReads);
+		stat.Miss(okey);
+		return backend->getchunk(okey, fldid, len, v);
+	}
+	if (len <= DSM_CACHE_BLOCK_SIZE || DSM_IS_READONLY_KEY(okey) || dsm_streaming)
+		return getrange(k, len, v);
+	SoStatus ret = SoOK;
+	uint32_t idx = 0;
+	while (idx < len)
+	{
+		uint64_t cur = k + idx;
+		uint32_t wlen = CACHE_BATCH_BLOCKS * DSM_CACHE_BLOCK_SIZE - (uint32_t)(cur & DSM_CACHE_LOW_MASK_64);
+		if (wlen > len - idx)
+			wlen = len - idx;
+		batchmiss(cur, wlen, NULL, NULL);
+		if (getrange(cur, wlen, v + idx) != SoOK)
+			ret = SoFail;
+		idx += wlen;
+	}
+	return ret;
+}
+
+
+SoStatus DSMDirectoryCache::Pin(ObjectKey okey, FieldKey fldid, uint32_t len)
+{
+	if (!len)
+		return SoOK;
+	uint64_t first = MAKE64(okey, fldid) & DSM_CACHE_HIGH_MASK_64;
+	uint64_t last = MAKE64(okey, (fldid + len - 1)) & DSM_CACHE_HIGH_MASK_64;
+	std::lock_guard<std::mutex> guard(pin_lock);
+	size_t newblocks = 0;
+	for (uint64_t b = first; b <= last; b += DSM_CACHE_BLOCK_SIZE)
+	{
+		if (pins.find(b) == pins.end())
+			newblocks++;
+	}
+	if (pins.size() + newblocks > (size_t)DogeeEnv::CacheConfig::max_pinned_blocks)
+		return SoFail;
+	//pinned blocks are always cached, even in a DsmStreamingScope
+	int streaming = dsm_streaming;
+	dsm_streaming = 0;
+	for (uint64_t b = first; b <= last; b += DSM_CACHE_BLOCK_SIZE)
+	{
+		if (pins[b]++)
+			continue;
+		for (;;)
+		{
+			doget(b, [](CacheBlock*){});
+			//the block may be swapped out before it is pinned
+			CacheBlock* blk = find_block(b);
+			if (blk)
+			{
+				blk->pinned = true;
+				UaLeaveReadRWLock(&blk->lock);
+				break;
+			}
+		}
+	}
+	dsm_streaming = streaming;
+	return SoOK;
+}
+
+void DSMDirectoryCache::Unpin(ObjectKey okey, FieldKey fldid, uint32_t len)
+{
+	if (!len)
+		return;
+	uint64_t first = MAKE64(okey, fldid) & DSM_CACHE_HIGH_MASK_64;
+	uint64_t last = MAKE64(okey, (fldid + len - 1)) & DSM_CACHE_HIGH_MASK_64;
+	std::lock_guard<std::mutex> guard(pin_lock);
+	for (uint64_t b = first; b <= last; b += DSM_CACHE_BLOCK_SIZE)
+	{
+		auto itr = pins.find(b);
+		if (itr == pins.end() || --itr->second)
+			continue;
+		pins.erase(itr);
+		CacheBlock* blk = find_block(b);
+		if (blk)
+		{
+			blk->pinned = false;
+			UaLeaveReadRWLock(&blk->lock);
+		}
+	}
+}
 
 }
\ No newline at end of file
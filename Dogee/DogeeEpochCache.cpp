@@ -0,0 +1,152 @@
+#include "DogeeEpochCache.h"
+#include "DogeeEnv.h"
+#include <string.h>
+
+namespace Dogee
+{
+	DSMEpochCache::DSMEpochCache(DSMCache* inner) : inner(inner), epoch(1)
+	{
+		max_blocks = DogeeEnv::CacheConfig::epoch_cache_blocks / EPOCH_CACHE_STRIPES;
+		if (max_blocks < 1)
+			max_blocks = 1;
+	}
+
+	DSMEpochCache::~DSMEpochCache()
+	{
+		delete inner;
+	}
+
+	void DSMEpochCache::shrink(Stripe& s, uint32_t cur)
+	{
+		for (auto itr = s.blocks.begin(); itr != s.blocks.end();)
+		{
+			if (itr->second.epoch != cur)
+				itr = s.blocks.erase(itr);
+			else
+				++itr;
+		}
+		//all the blocks are of this epoch, start over
+		if (s.blocks.size() >= max_blocks)
+			s.blocks.clear();
+	}
+
+	SoStatus DSMEpochCache::read(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)
+	{
+		uint32_t cur = epoch;
+		uint32_t idx = 0;
+		while (idx < len)
+		{
+			FieldKey fld = fldid + idx;
+			uint64_t baddr = MAKE64(key, fld) & DSM_CACHE_HIGH_MASK_64;
+			uint32_t offset = fld & DSM_CACHE_LOW_MASK;
+			uint32_t plen = DSM_CACHE_BLOCK_SIZE - offset;
+			if (plen > len - idx)
+				plen = len - idx;
+			//reads are counted by block, like the hits
+			stat.Inc(StatReads);
+			Stripe& s = stripe_of(baddr);
+			uint64_t writes;
+			{
+				std::lock_guard<std::mutex> guard(s.lock);
+				auto itr = s.blocks.find(baddr);
+				if (itr != s.blocks.end() && itr->second.epoch == cur)
+				{
+					stat.Inc(StatReadHits);
+					memcpy(buf + idx, itr->second.data + offset, sizeof(uint32_t)*plen);
+					idx += plen;
+					continue;
+				}
+				writes = s.writes;
+			}
+			stat.Miss(key);
+			EpochBlock blk;
+			blk.epoch = cur;
+			SoStatus ret = inner->getchunk(key, fld & DSM_CACHE_HIGH_MASK, DSM_CACHE_BLOCK_SIZE, blk.data);
+			if (ret != SoOK)
+				return ret;
+			memcpy(buf + idx, blk.data + offset, sizeof(uint32_t)*plen);
+			{
+				std::lock_guard<std::mutex> guard(s.lock);
+				if (s.writes == writes)
+				{
+					if (s.blocks.size() >= max_blocks && s.blocks.find(baddr) == s.blocks.end())
+						shrink(s, cur);
+					s.blocks[baddr] = blk;
+				}
+			}
+			idx += plen;
+		}
+		return SoOK;
+	}
+
+	void DSMEpochCache::update(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)
+	{
+		uint32_t cur = epoch;
+		uint32_t idx = 0;
+		while (idx < len)
+		{
+			FieldKey fld = fldid + idx;
+			uint64_t baddr = MAKE64(key, fld) & DSM_CACHE_HIGH_MASK_64;
+			uint32_t offset = fld & DSM_CACHE_LOW_MASK;
+			uint32_t plen = DSM_CACHE_BLOCK_SIZE - offset;
+			if (plen > len - idx)
+				plen = len - idx;
+			Stripe& s = stripe_of(baddr);
+			std::lock_guard<std::mutex> guard(s.lock);
+			s.writes++;
+			auto itr = s.blocks.find(baddr);
+			if (itr != s.blocks.end() && itr->second.epoch == cur)
+				memcpy(itr->second.data + offset, buf + idx, sizeof(uint32_t)*plen);
+			idx += plen;
+		}
+	}
+
+	SoStatus DSMEpochCache::put(ObjectKey key, FieldKey fldid, uint64_t v)
+	{
+		stat.Inc(StatWrites);
+		SoStatus ret = inner->put(key, fldid, v);
+		update(key, fldid, 2, (uint32_t*)&v);
+		return ret;
+	}
+
+	SoStatus DSMEpochCache::put(ObjectKey key, FieldKey fldid, uint32_t v)
+	{
+		stat.Inc(StatWrites);
+		SoStatus ret = inner->put(key, fldid, v);
+		update(key, fldid, 1, &v);
+		return ret;
+	}
+
+	uint32_t DSMEpochCache::get(ObjectKey key, FieldKey fldid)
+	{
+		uint32_t ret = 0;
+		read(key, fldid, 1, &ret);
+		return ret;
+	}
+
+	SoStatus DSMEpochCache::getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf)
+	{
+		return read(key, fldid, len * 2, (uint32_t*)buf);
+	}
+
+	SoStatus DSMEpochCache::getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)
+	{
+		return read(key, fldid, len, buf);
+	}
+
+	SoStatus DSMEpochCache::putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf)
+	{
+		stat.Inc(StatWrites);
+		SoStatus ret = inner->putchunk(key, fldid, len, buf);
+		update(key, fldid, len * 2, (uint32_t*)buf);
+		return ret;
+	}
+
+	SoStatus DSMEpochCache::putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)
+	{
+		stat.Inc(StatWrites);
+		SoStatus ret = inner->putchunk(key, fldid, len, buf);
+		update(key, fldid, len, buf);
+		return ret;
+	}
+}
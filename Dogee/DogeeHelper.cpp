@@ -21,6 +21,12 @@ namespace Dogee
 		SoStorageFactory factory(backty, cachety);
 		backend = factory.make(mem_hosts, mem_ports);
 		cache = factory.makecache(backend, hosts, ports, node_id);
+		if (CacheConfig::epoch_cache)
+			cache = new DSMEpochCache(cache);
+		if (!CacheConfig::trace_path.empty())
+			cache = new DSMTraceCache(cache, CacheConfig::trace_path, node_id);
+		if (CacheConfig::stat_dump_interval > 0)
+			cache->GetStat().StartDump(CacheConfig::stat_dump_interval);
 		std::hash<std::thread::id> h;
 		srand((int)time(NULL) ^ (int)h(std::this_thread::get_id()));
 		RcInitThreadSystem();
@@ -15,6 +15,7 @@
 #include <map>
 #include <assert.h>
 #include "DogeeUtil.h"
+#include "DogeeThreading.h"
 
 #ifdef _WIN32
 int RcWinsockStartup()
@@ -186,7 +187,7 @@ namespace Dogee
 					node = new SyncNode;
 					node->data = 0;
 					node->Kind = SyncNode::Barrier;
-					node->data = (int)DogeeEnv::cache->get(b_id, 0);
+					node->data = (int)DogeeEnv::cache->get(b_id, DBarrier(b_id).count.GetFieldId());
 					node->val = 0;
 					node->waitlist = new std::vector<SyncThreadNode>;
 					sync_data[b_id] = node;
@@ -231,8 +232,8 @@ namespace Dogee
 					node = new SyncNode;
 					node->data = 0;
 					node->Kind = SyncNode::Semaphore;
-					uint64_t val = DogeeEnv::cache->get(b_id, 0);
-					node->data = *(int*)&val;
+					uint64_t val = DogeeEnv::cache->get(b_id, DSemaphore(b_id).count.GetFieldId());
+					node->data = (int)val;
 					node->val = node->data;
 					node->waitqueue = new std::queue<SyncThreadNode>;
 					sync_data[b_id] = node;
@@ -270,8 +271,8 @@ namespace Dogee
 					node = new SyncNode;
 					node->data = 0;
 					node->Kind = SyncNode::Semaphore;
-					uint64_t val = DogeeEnv::cache->get(b_id, 0);
-					node->data = *(int*)val;
+					uint64_t val = DogeeEnv::cache->get(b_id, DSemaphore(b_id).count.GetFieldId());
+					node->data = (int)val;
 					node->val = node->data;
 					node->waitqueue = new std::queue<SyncThreadNode>;
 					sync_data[b_id] = node;
@@ -281,7 +282,8 @@ namespace Dogee
 					node = itr->second;
 				}
 				node->val++;
-				if (node->val >= 0)
+				//a thread was waiting if the count was negative
+				if (node->val <= 0)
 				{
 					if (!node->waitqueue->empty())
 					{
@@ -300,9 +302,9 @@ namespace Dogee
 				if (itr == sync_data.end())
 				{
 					node = new SyncNode;
-					node->data = DogeeEnv::cache->get(b_id, 0); //->data=auto_reset
+					node->data = DogeeEnv::cache->get(b_id, DEvent(b_id).auto_reset.GetFieldId());
 					node->Kind = SyncNode::Event;
-					node->val = DogeeEnv::cache->get(b_id, 2); //->val=is_signal
+					node->val = DogeeEnv::cache->get(b_id, DEvent(b_id).is_signal.GetFieldId());
 					node->waitqueue = new std::queue<SyncThreadNode>;
 					sync_data[b_id] = node;
 				}
@@ -981,8 +983,16 @@ namespace Dogee
 		DeleteDThreadPool();
 	}
 
+	//make the writes of the current thread visible before notifying other nodes
+	void RcRelease()
+	{
+		ReleaseLocalMappings();
+		DogeeEnv::cache->Fence();
+	}
+
 	int RcCreateThread(int node_id,uint32_t idx,uint32_t param,ObjectKey okey)
 	{
+		RcRelease();
 		assert(DogeeEnv::isMaster());
 		int _idx = idx;
 		int _param = param;
@@ -995,6 +1005,7 @@ namespace Dogee
 
 	int RcCreateThread(int node_id, uint32_t idx, uint32_t param, ObjectKey okey,void* data,uint32_t len)
 	{
+		RcRelease();
 		assert(DogeeEnv::isMaster());
 		int _idx = idx;
 		int _param = param;
@@ -1139,6 +1150,7 @@ namespace Dogee
 
 	bool RcEnterBarrier(ObjectKey okey, int timeout)
 	{
+		RcRelease();
 		ThreadEventMap[current_thread_id]->ResetEvent();
 		if (DogeeEnv::isMaster())
 		{
@@ -1152,12 +1164,15 @@ namespace Dogee
 			cmd.param2 = current_thread_id;
 			RcSend(master_socket, &cmd, sizeof(cmd));
 		}
-		return ThreadEventMap[current_thread_id]->WaitForEvent(timeout);
+		bool ret = ThreadEventMap[current_thread_id]->WaitForEvent(timeout);
+		DogeeEnv::cache->NewEpoch();
+		return ret;
 	}
 
 
 	void RcSetEvent(ObjectKey okey)
 	{
+		RcRelease();
 		if (DogeeEnv::isMaster())
 		{
 			MasterZone::syncmanager->SetEventMsg(0, okey);
@@ -1172,6 +1187,7 @@ namespace Dogee
 	}
 	void RcResetEvent(ObjectKey okey)
 	{
+		RcRelease();
 		if (DogeeEnv::isMaster())
 		{
 			MasterZone::syncmanager->ResetEventMsg(0, okey);
@@ -1186,6 +1202,7 @@ namespace Dogee
 	}
 	bool RcWaitForEvent(ObjectKey okey, int timeout)
 	{
+		RcRelease();
 		ThreadEventMap[current_thread_id]->ResetEvent();
 		if (DogeeEnv::isMaster())
 		{
@@ -1204,6 +1221,7 @@ namespace Dogee
 
 	bool RcEnterSemaphore(ObjectKey okey, int timeout)
 	{
+		RcRelease();
 		ThreadEventMap[current_thread_id]->ResetEvent();
 		if (DogeeEnv::isMaster())
 		{
@@ -1222,6 +1240,7 @@ namespace Dogee
 
 	void RcLeaveSemaphore(ObjectKey okey)
 	{
+		RcRelease();
 		if (DogeeEnv::isMaster())
 		{
 			MasterZone::syncmanager->SemaphoreLeaveMsg(0, okey, current_thread_id);
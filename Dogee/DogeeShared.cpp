@@ -8,10 +8,12 @@
 #include <sstream>
 #include <limits>
 #include <mutex>
+#include <atomic>
 #include <set>
 #include <string>
 #include <vector>
 #include <iterator>
+#include <algorithm>
 #include "DogeeAPIWrapping.h"
 
 #define DOGEE_CONFIG_VER 1
@@ -22,6 +24,10 @@ namespace Dogee
 	ObjectKey objid=1;
 	FieldKey gloabl_fid = 0;
 	THREAD_LOCAL DObject* lastobject = nullptr;
+	THREAD_LOCAL int dsm_streaming = 0;
+	//the first and the last of the local mappings of the thread
+	static THREAD_LOCAL DsmLocalMapping* local_mappings = nullptr;
+	static THREAD_LOCAL DsmLocalMapping* local_mappings_tail = nullptr;
 	SoStorage* DogeeEnv::backend=nullptr;
 	DSMCache* DogeeEnv::cache=nullptr;
 	bool DogeeEnv::_isMaster = false;
@@ -31,6 +37,25 @@ namespace Dogee
 	DThreadPool* DogeeEnv::ThreadPoolConfig::thread_pool = nullptr;
 	DThreadPoolScheduler* DogeeEnv::ThreadPoolConfig::scheduler = nullptr;
 	int DogeeEnv::ThreadPoolConfig::thread_pool_max_wait = 256;
+	int DogeeEnv::CacheConfig::prefetch_max_depth = 0;
+	int DogeeEnv::CacheConfig::prefetch_threads = 2;
+	int DogeeEnv::CacheConfig::protocal_threads = 4;
+	bool DogeeEnv::CacheConfig::home_owned_blocks = false;
+	int DogeeEnv::CacheConfig::home_max_blocks = 1 << 16;
+	int DogeeEnv::CacheConfig::migrate_writes = 0;
+	//a quarter of DSM_CACHE_SIZE
+	int DogeeEnv::CacheConfig::max_pinned_blocks = 256;
+	DogeeEnv::CacheConfig::CoherenceMode DogeeEnv::CacheConfig::coherence = DogeeEnv::CacheConfig::CoherenceUpdate;
+	int DogeeEnv::CacheConfig::coherence_drop_updates = 4;
+	bool DogeeEnv::CacheConfig::write_combining = false;
+	bool DogeeEnv::CacheConfig::multiple_writers = false;
+	int DogeeEnv::CacheConfig::stat_dump_interval = 0;
+	int DogeeEnv::CacheConfig::stat_hot_objects = 10;
+	bool DogeeEnv::CacheConfig::epoch_cache = false;
+	int DogeeEnv::CacheConfig::epoch_cache_blocks = 1 << 16;
+	std::string DogeeEnv::CacheConfig::trace_path;
+	int DogeeEnv::CacheConfig::view_window = ARRAY_COPY_WORDS;
+	int DogeeEnv::CacheConfig::view_prefetch_threads = 1;
 
 	DogeeEnv::InitStorageCurrentThreadProc DogeeEnv::InitStorageCurrentThread = nullptr;
 	DogeeEnv::InitStorageCurrentThreadProc DogeeEnv::DestroyStorageCurrentThread = nullptr;
@@ -46,10 +71,77 @@ namespace Dogee
 		std::lock_guard<std::mutex> lock(object_list_lock);
 		return object_list.size();
 	}
+	void AddLocalMapping(DsmLocalMapping* m)
+	{
+		m->prev = local_mappings_tail;
+		m->next = nullptr;
+		if (local_mappings_tail)
+			local_mappings_tail->next = m;
+		else
+			local_mappings = m;
+		local_mappings_tail = m;
+	}
+
+	void RemoveLocalMapping(DsmLocalMapping* m)
+	{
+		if (m->prev)
+			m->prev->next = m->next;
+		else if (local_mappings == m)
+			local_mappings = m->next;
+		if (m->next)
+			m->next->prev = m->prev;
+		else if (local_mappings_tail == m)
+			local_mappings_tail = m->prev;
+		m->prev = m->next = nullptr;
+	}
+
+	void ReleaseLocalMappings()
+	{
+		for (DsmLocalMapping* m = local_mappings; m; m = m->next)
+			m->Release();
+	}
+
+	/*
+	The node-local cache of GetClassId. Only ReadOnly keys are cached, as
+	they are seldom allocated again (see NextReadOnlyKey). Another key may
+	be deleted and allocated again with another class by any node, and a
+	node would not know that its entry is stale
+	*/
+	std::mutex class_id_lock;
+	std::unordered_map<ObjectKey, uint32_t> class_ids;
+
+	uint32_t GetClassId(ObjectKey obj_id)
+	{
+		bool cached = DSM_IS_READONLY_KEY(obj_id);
+		if (cached)
+		{
+			std::lock_guard<std::mutex> lock(class_id_lock);
+			auto itr = class_ids.find(obj_id);
+			if (itr != class_ids.end())
+				return itr->second;
+		}
+		uint32_t ret = 0, size;
+		if (DogeeEnv::backend->getinfo(obj_id, ret, size) != SoOK)
+			return ret;
+		if (cached)
+		{
+			std::lock_guard<std::mutex> lock(class_id_lock);
+			class_ids[obj_id] = ret;
+		}
+		return ret;
+	}
+
 	void DeleteObject(ObjectKey key)
 	{
-		std::unique_lock<std::mutex> lock(object_list_lock);
-		object_list.erase(key);
+		{
+			std::lock_guard<std::mutex> lock(class_id_lock);
+			class_ids.erase(key);
+		}
+		{
+			std::unique_lock<std::mutex> lock(object_list_lock);
+			object_list.erase(key);
+		}
+		DogeeEnv::backend->del(key);
 	}
 
 	void PushObject(ObjectKey key)
@@ -65,17 +157,41 @@ namespace Dogee
 			func(key);
 	}
 
-	ObjectKey AllocObjectId(uint32_t cls_id, uint32_t size)
+	/*
+	The next key of the read-only range of this node (see DSM_READONLY_NODE_SHIFT).
+	It starts at a random point, so that a restarted node seldom meets the
+	keys it allocated before
+	*/
+	static ObjectKey NextReadOnlyKey()
+	{
+		static std::atomic<uint32_t> seq(rand());
+		return DSM_READONLY_KEY_BIT | ((uint32_t)DogeeEnv::self_node_id << DSM_READONLY_NODE_SHIFT & ~DSM_READONLY_KEY_BIT)
+			| (seq++ & DSM_READONLY_SEQ_MASK);
+	}
+
+	ObjectKey AllocObjectId(uint32_t cls_id, uint32_t size, AllocHint hint)
 	{
 		ObjectKey key = 0;
 		bool found = false;
 		for (int i = 0; i<DOGEE_MAX_SHARED_KEY_TRIES; i++)
 		{
+			key = 0;
+			if (hint == ReadOnly)
+				key = NextReadOnlyKey();
 			while (key == 0)
-				key = rand();
+			{
+				key = rand() & ~(DSM_READONLY_KEY_BIT | DSM_INVALIDATE_KEY_BIT);
+				if (hint == WriteInvalidate)
+					key |= DSM_INVALIDATE_KEY_BIT;
+			}
 			if (DogeeEnv::backend->newobj(key, cls_id, size) == SoOK)
 			{
 				PushObject(key);
+				if (hint == ReadOnly)
+				{
+					std::lock_guard<std::mutex> lock(class_id_lock);
+					class_ids[key] = cls_id;
+				}
 				found = true;
 				break;
 			}
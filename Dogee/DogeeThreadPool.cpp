@@ -63,12 +63,23 @@ namespace Dogee
 		else
 			local_thread_pool = nullptr;
 	}
+	LThreadPool* GetLocalThreadPool()
+	{
+		return local_thread_pool;
+	}
 	void DeleteLocalThreadPool()
 	{
 		if (local_thread_pool)
 			delete local_thread_pool;
 	}
 
+	LThreadPool* ArrayViewPrefetcher()
+	{
+		static std::unique_ptr<LThreadPool> pool(DogeeEnv::CacheConfig::view_prefetch_threads > 0 ?
+			new LThreadPool(DogeeEnv::CacheConfig::view_prefetch_threads) : nullptr);
+		return pool.get();
+	}
+
 	void InitDThreadPool()
 	{
 		DThreadPoolScheduler* sche;
@@ -89,12 +100,17 @@ namespace Dogee
 	}
 
 
+	extern void RcRelease();
 	void ExecuteClosureInLocalThreadPool(char* obj, uint32_t param, int id, uint32_t devent,bool need_free)
 	{
 		typedef void(*pCall)(char* ptr, uint32_t param);
 		pCall funcall = (pCall)GetIDProcMap()[id];
 		auto lam = [funcall, obj, param, devent, need_free](){
+			//the closure and the event may access the DSM
+			DogeeEnv::InitCurrentThread();
 			funcall(obj, param);
+			//publish the writes of the closure, even if no event waits for it (see DThreadPool::submit2)
+			RcRelease();
 			if (devent)
 			{
 				Ref<DEvent> ev(devent);
@@ -109,6 +125,8 @@ namespace Dogee
 	extern void AcExecuteClosureInThreadPool(int nodeid, uint32_t param, uint32_t event, int id, char* obj, size_t sz);
 	void SendClosureToThreadPool(int nodeid,uint32_t param,uint32_t event,int id,char* obj,size_t sz)
 	{
+		//the closure may read what this thread has written, on this node or another
+		RcRelease();
 		if (nodeid == DogeeEnv::self_node_id)
 			ExecuteClosureInLocalThreadPool(obj, param, id, event , false);
 		else
@@ -0,0 +1,148 @@
+#include "DogeeTraceCache.h"
+#include <chrono>
+#include <atomic>
+
+namespace Dogee
+{
+	/*
+	The writer of a thread is only used by the trace cache which made it,
+	"owner" is the instance_id of that cache
+	*/
+	struct ThreadTraceWriter
+	{
+		uint32_t owner;
+		void* writer;
+	};
+	static THREAD_LOCAL ThreadTraceWriter thread_trace_writer = { 0, nullptr };
+
+	static uint64_t NowMicroseconds()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	DSMTraceCache::DSMTraceCache(DSMCache* inner, const std::string& path, int node_id)
+		: inner(inner), path(path), node_id(node_id)
+	{
+		static std::atomic<uint32_t> instances = ATOMIC_VAR_INIT(0);
+		instance_id = ++instances;
+	}
+
+	DSMTraceCache::~DSMTraceCache()
+	{
+		for (TraceWriter* w : writers)
+		{
+			if (w->f)
+			{
+				flush(w);
+				fclose(w->f);
+			}
+			delete w;
+		}
+		delete inner;
+	}
+
+	DSMTraceCache::TraceWriter* DSMTraceCache::writer()
+	{
+		ThreadTraceWriter& tw = thread_trace_writer;
+		if (tw.owner == instance_id)
+			return (TraceWriter*)tw.writer;
+		TraceWriter* w = new TraceWriter;
+		uint32_t thread;
+		{
+			std::lock_guard<std::mutex> guard(writers_lock);
+			thread = (uint32_t)writers.size();
+			writers.push_back(w);
+		}
+		char name[32];
+		snprintf(name, sizeof(name), ".%d.%u.trace", node_id, thread);
+		w->f = fopen((path + name).c_str(), "wb");
+		if (!w->f)
+			printf("Cannot open the trace file %s%s\n", path.c_str(), name);
+		w->n = 0;
+		w->last_us = NowMicroseconds();
+		TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, (uint32_t)node_id, thread, w->last_us };
+		if (w->f)
+			fwrite(&header, sizeof(header), 1, w->f);
+		tw.owner = instance_id;
+		tw.writer = w;
+		return w;
+	}
+
+	void DSMTraceCache::flush(TraceWriter* w)
+	{
+		if (w->n && w->f)
+			fwrite(w->records, sizeof(TraceRecord), w->n, w->f);
+		w->n = 0;
+	}
+
+	void DSMTraceCache::record(TraceOp op, ObjectKey key, FieldKey fldid, uint32_t len)
+	{
+		TraceWriter* w = writer();
+		uint64_t now = NowMicroseconds();
+		uint64_t dt = now - w->last_us;
+		w->last_us = now;
+		do
+		{
+			uint32_t rlen = len > TRACE_MAX_LEN ? TRACE_MAX_LEN : len;
+			TraceRecord& r = w->records[w->n];
+			r.addr = MAKE64(key, fldid);
+			r.oplen = ((uint32_t)op << 24) | rlen;
+			r.dt = dt > 0xffffffff ? 0xffffffff : (uint32_t)dt;
+			dt = 0;
+			if (++w->n == TRACE_BUFFER_RECORDS)
+				flush(w);
+			fldid += rlen;
+			len -= rlen;
+		} while (len);
+	}
+
+	SoStatus DSMTraceCache::put(ObjectKey key, FieldKey fldid, uint64_t v)
+	{
+		stat.Inc(StatWrites);
+		record(TracePut, key, fldid, 2);
+		return inner->put(key, fldid, v);
+	}
+
+	SoStatus DSMTraceCache::put(ObjectKey key, FieldKey fldid, uint32_t v)
+	{
+		stat.Inc(StatWrites);
+		record(TracePut, key, fldid, 1);
+		return inner->put(key, fldid, v);
+	}
+
+	uint32_t DSMTraceCache::get(ObjectKey key, FieldKey fldid)
+	{
+		stat.Inc(StatReads);
+		record(TraceGet, key, fldid, 1);
+		return inner->get(key, fldid);
+	}
+
+	SoStatus DSMTraceCache::getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf)
+	{
+		stat.Inc(StatReads);
+		record(TraceGetChunk, key, fldid, len * 2);
+		return inner->getchunk(key, fldid, len, buf);
+	}
+
+	SoStatus DSMTraceCache::getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)
+	{
+		stat.Inc(StatReads);
+		record(TraceGetChunk, key, fldid, len);
+		return inner->getchunk(key, fldid, len, buf);
+	}
+
+	SoStatus DSMTraceCache::putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf)
+	{
+		stat.Inc(StatWrites);
+		record(TracePutChunk, key, fldid, len * 2);
+		return inner->putchunk(key, fldid, len, buf);
+	}
+
+	SoStatus DSMTraceCache::putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)
+	{
+		stat.Inc(StatWrites);
+		record(TracePutChunk, key, fldid, len);
+		return inner->putchunk(key, fldid, len, buf);
+	}
+}
@@ -18,6 +18,8 @@
 #include "DogeeSharedConst.h"
 #include "DogeeString.h"
 #include "DogeeDThreadPool.h"
+#include "DogeePartitionedArray.h"
+#include <algorithm>
 #include <chrono>
 #include <memory>
 #include <thread>
@@ -230,6 +232,541 @@ void singlewritetest()
 	std::cout << "SW OK" << typeid(T).name() << std::endl;
 }
 
+template <typename T>
+void readonlytest()
+{
+	auto ptr2 = Dogee::NewArray<T>(100, ReadOnly);
+	int last = 23, cur;
+	for (int i = 0; i < 100; i++)
+	{
+		cur = last * 34 - i * 99 + 9;
+		ptr2[i] = cur;
+		last = cur;
+	}
+	last = 23;
+	T buf[100];
+	ptr2->CopyTo(buf, 0, 100);
+	for (int i = 0; i < 100; i++)
+	{
+		cur = last * 34 - i * 99 + 9;
+		last = cur;
+		if (ptr2[i] != cur || buf[i] != cur)
+		{
+			std::cout << "RO ERR" << i << std::endl;
+			break;
+		}
+	}
+	std::cout << "RO OK" << typeid(T).name() << std::endl;
+}
+
+struct TestPoint
+{
+	float x, y, z;
+	int label;
+};
+struct TestShort3
+{
+	short a, b, c;
+};
+
+void structtest()
+{
+	auto pts = Dogee::NewArray<TestPoint>(100);
+	auto shs = Dogee::NewArray<TestShort3>(100);
+	TestPoint pbuf[100];
+	TestShort3 sbuf[100];
+	for (int i = 0; i < 100; i++)
+	{
+		pbuf[i] = { i * 0.5f, i * 1.5f, i * 2.5f, i };
+		sbuf[i] = { (short)i, (short)(i * 2), (short)(i * 3) };
+	}
+	pts->CopyFrom(pbuf, 0, 100);
+	shs->CopyFrom(sbuf + 10, 10, 90);
+	for (int i = 0; i < 10; i++)
+		shs[i] = sbuf[i];
+	TestPoint pbuf2[50];
+	TestShort3 sbuf2[50];
+	pts->CopyTo(pbuf2, 30, 50);
+	shs->CopyTo(sbuf2, 30, 50);
+	for (int i = 0; i < 100; i++)
+	{
+		TestPoint p = pts[i];
+		TestShort3 sh = shs[i];
+		if (p.y != i * 1.5f || p.label != i || sh.c != i * 3
+			|| (i >= 30 && i < 80 && (pbuf2[i - 30].z != i * 2.5f || sbuf2[i - 30].b != i * 2)))
+		{
+			std::cout << "STRUCT ERR" << i << std::endl;
+			return;
+		}
+	}
+	std::cout << "STRUCT OK" << std::endl;
+}
+
+void packedtest()
+{
+	auto flags = Dogee::NewArray<Packed<bool>>(100);
+	auto labels = Dogee::NewArray<Packed<uint8_t, 2>>(100);
+	bool fbuf[100];
+	uint8_t lbuf[100];
+	for (int i = 0; i < 100; i++)
+	{
+		fbuf[i] = (i % 3 == 0);
+		lbuf[i] = i % 4;
+	}
+	flags->CopyFrom(fbuf + 5, 5, 95);
+	for (int i = 0; i < 5; i++)
+		flags[i] = fbuf[i];
+	labels->CopyFrom(lbuf, 0, 100);
+	bool fbuf2[50];
+	uint8_t lbuf2[50];
+	flags->CopyTo(fbuf2, 33, 50);
+	labels->CopyTo(lbuf2, 17, 50);
+	for (int i = 0; i < 100; i++)
+	{
+		if (flags[i] != fbuf[i] || labels[i] != lbuf[i]
+			|| (i >= 33 && i < 83 && fbuf2[i - 33] != fbuf[i]) || (i >= 17 && i < 67 && lbuf2[i - 17] != lbuf[i]))
+		{
+			std::cout << "PACKED ERR" << i << std::endl;
+			return;
+		}
+	}
+	std::cout << "PACKED OK" << std::endl;
+}
+
+void snapshottest()
+{
+	Ref<clsa> obj = Dogee::NewObj<clsa>(3);
+	Ref<clsa> other = obj;
+	obj->i = 1;
+	obj.Fetch();
+	obj->i = 2;
+	obj->next2 = obj;
+	if (other->i != 1)
+	{
+		std::cout << "SNAPSHOT ERR before commit" << std::endl;
+		return;
+	}
+	obj.Commit();
+	obj.Fetch();
+	obj->i = 3;
+	obj.Discard();
+	if (other->i != 2 || other->next2->i != 2 || obj->arr[2] != 3)
+	{
+		std::cout << "SNAPSHOT ERR" << std::endl;
+		return;
+	}
+	std::cout << "SNAPSHOT OK" << std::endl;
+}
+
+void viewtest()
+{
+	auto arr = Dogee::NewArray<int>(5000);
+	auto v = arr->view(0, 5000);
+	int k = 0;
+	for (auto e : v)
+		e = 5000 - (k++);
+	std::sort(v.begin() + 10, v.end());
+	v.Flush();
+	const Dogee::ArrayView<int> cv = arr->view(0, 5000);
+	long long sum = 0;
+	for (int x : cv)
+		sum += x;
+	if (sum != 12502500LL || arr[0] != 5000 || arr[10] != 1 || arr[4999] != 4990)
+	{
+		std::cout << "VIEW ERR" << std::endl;
+		return;
+	}
+	//only the written elements are written back, not the ones between them
+	auto sv = arr->view(0, 5000);
+	sv[0] = -1;
+	sv[1] = -2;
+	sv[20] = -3;
+	arr[10] = 7;
+	sv.Flush();
+	if (arr[0] != -1 || arr[1] != -2 || arr[10] != 7 || arr[20] != -3)
+	{
+		std::cout << "VIEW ERR" << std::endl;
+		return;
+	}
+	std::cout << "VIEW OK" << std::endl;
+}
+
+class LayoutBase : public DObject
+{
+	DefBegin(DObject);
+public:
+	Def(a, int);
+	Def(d, double);
+	Def(b, int);
+	Def(p, TestPoint);
+	DefEnd();
+	LayoutBase(ObjectKey obj_id) : DObject(obj_id)
+	{
+	}
+};
+
+class LayoutDerived : public LayoutBase
+{
+	DefBegin(LayoutBase);
+public:
+	Def(c, int);
+	Def(l, long long);
+	Def(s, TestShort3);
+	DefEnd();
+	LayoutDerived(ObjectKey obj_id) : LayoutBase(obj_id)
+	{
+	}
+};
+
+void layouttest()
+{
+	//the 8-byte fields start at even words, the structs take the words of their size
+	LayoutDerived obj(0);
+	if (obj.a.GetFieldId() != 0 || obj.d.GetFieldId() != 2 || obj.b.GetFieldId() != 4
+		|| obj.p.GetFieldId() != 6 || LayoutBase::_LAST_ != 10
+		|| obj.c.GetFieldId() != 10 || obj.l.GetFieldId() != 12 || obj.s.GetFieldId() != 14
+		|| LayoutDerived::_LAST_ != 16 || DEvent(0).is_signal.GetFieldId() != 1)
+	{
+		std::cout << "LAYOUT ERR" << std::endl;
+		return;
+	}
+	std::cout << "LAYOUT OK" << std::endl;
+}
+
+//large enough for a few batches of the cyclic ForEachLocal
+#define PART_SIZE 10000
+DefGlobal(part_blk, Ref<DPartitionedArray<int>>);
+DefGlobal(part_cyc, Ref<DPartitionedArray<int>>);
+DefGlobal(part_barrier, Ref<DBarrier>);
+
+//run on each node owning elements: fill the elements of the node, then read the halo from the neighbours
+void partitionproc(uint32_t param)
+{
+	auto fill = [](uint32_t i, int& e) { e = (int)i * 3; };
+	part_blk->ForEachLocal(fill);
+	part_cyc->ForEachLocal(fill);
+	part_barrier->Enter();
+	std::vector<int> left, right;
+	part_blk->FetchHalo(5, left, right);
+	PartitionRange r = part_blk->LocalRange();
+	bool ok = left.size() == std::min(5u, r.start) && right.size() == std::min(5u, PART_SIZE - r.start - r.len);
+	for (size_t k = 0; ok && k < left.size(); k++)
+		ok = left[k] == (int)(r.start - left.size() + k) * 3;
+	for (size_t k = 0; ok && k < right.size(); k++)
+		ok = right[k] == (int)(r.start + r.len + k) * 3;
+	std::cout << (ok ? "HALO OK" : "HALO ERR") << std::endl;
+}
+RegFunc(partitionproc);
+
+void partitiontest()
+{
+	const uint32_t parts = DPartitionedArray<int>::NumParts();
+	const int first_node = DogeeEnv::num_nodes > 1 ? 1 : 0;
+	part_blk = NewObj<DPartitionedArray<int>>(PART_SIZE);
+	part_cyc = NewObj<DPartitionedArray<int>>(PART_SIZE, PartitionCyclic, 7);
+	part_barrier = NewObj<DBarrier>(parts);
+	//the ranges of the nodes cover every element once, and the owner of an element is the node whose range holds it
+	Ref<DPartitionedArray<int>> arrs[] = { part_blk, part_cyc };
+	for (auto& a : arrs)
+	{
+		std::vector<int> owners(PART_SIZE, -1);
+		for (uint32_t p = 0; p < parts; p++)
+		{
+			for (PartitionRange r : a->Ranges(first_node + p))
+			{
+				for (uint32_t i = r.start; i < r.start + r.len; i++)
+					owners[i] = (owners[i] == -1 && a->Owner(i) == first_node + (int)p) ? first_node + p : -2;
+			}
+		}
+		if (std::count(owners.begin(), owners.end(), -1) || std::count(owners.begin(), owners.end(), -2))
+		{
+			std::cout << "PARTITION ERR ranges" << std::endl;
+			return;
+		}
+	}
+	if (part_cyc->Owner(6) != first_node || part_cyc->Owner(7) != first_node + (int)(1 % parts))
+	{
+		std::cout << "PARTITION ERR cyclic" << std::endl;
+		return;
+	}
+	if (first_node == 0)
+		partitionproc(0);
+	else
+	{
+		std::vector<Ref<DThread>> threads;
+		for (uint32_t p = 0; p < parts; p++)
+			threads.push_back(NewObj<DThread>(partitionproc, first_node + p, 0));
+		for (auto& th : threads)
+			th->Join();
+	}
+	for (int i = 0; i < PART_SIZE; i++)
+	{
+		if (part_blk->GetArray()[i] != i * 3 || part_cyc->GetArray()[i] != i * 3)
+		{
+			std::cout << "PARTITION ERR" << i << std::endl;
+			return;
+		}
+	}
+	part_blk->Destroy();
+	part_cyc->Destroy();
+	std::cout << "PARTITION OK" << std::endl;
+}
+
+DefGlobal(span_arr, Array<int>);
+DefGlobal(span_ok, int);
+
+//sees the word written back by the span of the master at its release, and writes a word the span does not change
+void spanproc(uint32_t param)
+{
+	span_ok = span_arr[10] == 1000 && span_arr[11] == 11;
+	span_arr[20] = 2000;
+}
+RegFunc(spanproc);
+
+void spantest()
+{
+	span_arr = NewArray<int>(100);
+	for (int i = 0; i < 100; i++)
+		span_arr[i] = i;
+	LocalSpan<int> span = span_arr->MapLocal(10, 50);
+	span[0] = 1000;
+	if (span_arr[10] != 10)
+	{
+		std::cout << "SPAN ERR written before release" << std::endl;
+		return;
+	}
+	//a barrier is a release point
+	NewObj<DBarrier>(1)->Enter();
+	if (DogeeEnv::num_nodes > 1)
+		NewObj<DThread>(spanproc, 1, 0)->Join();
+	else
+		spanproc(0);
+	//only the changed word is written back, keeping the word written by the other node
+	span[1] = 1001;
+	span.Flush();
+	if (!span_ok || span_arr[11] != 1001 || span_arr[20] != 2000 || span[10] != 20)
+	{
+		std::cout << "SPAN ERR flush" << std::endl;
+		return;
+	}
+	span.Refresh();
+	if (span[10] != 2000 || span[1] != 1001)
+	{
+		std::cout << "SPAN ERR refresh" << std::endl;
+		return;
+	}
+	std::cout << "SPAN OK" << std::endl;
+}
+
+class VRefBase : public DObject
+{
+	DefBegin(DObject);
+public:
+	Def(v, int);
+	DefEnd();
+	//a local member with a destructor, so that a missed or repeated destruction shows up in a checker
+	std::vector<int> local;
+	VRefBase(ObjectKey obj_id) : DObject(obj_id), local(4)
+	{
+	}
+	VRefBase(ObjectKey obj_id, int v) : DObject(obj_id), local(4)
+	{
+		self->v = v;
+	}
+	virtual int kind()
+	{
+		return 0;
+	}
+};
+
+//made in the storage of the reference
+class VRefSmall : public VRefBase
+{
+	DefBegin(VRefBase);
+public:
+	DefEnd();
+	VRefSmall(ObjectKey obj_id) : VRefBase(obj_id)
+	{
+	}
+	VRefSmall(ObjectKey obj_id, int v) : VRefBase(obj_id, v)
+	{
+	}
+	virtual int kind()
+	{
+		return 1;
+	}
+};
+
+//too large for the storage of the reference, made on the heap
+class VRefBig : public VRefBase
+{
+	DefBegin(VRefBase);
+public:
+	DefEnd();
+	double pad[VIRTUAL_REF_INLINE_SIZE / sizeof(double)];
+	VRefBig(ObjectKey obj_id) : VRefBase(obj_id)
+	{
+	}
+	VRefBig(ObjectKey obj_id, int v) : VRefBase(obj_id, v)
+	{
+	}
+	virtual int kind()
+	{
+		return 2;
+	}
+};
+
+void vreftest()
+{
+	Ref<VRefBase, true> small(NewObj<VRefSmall>(1));
+	Ref<VRefBase, true> big(NewObj<VRefBig>(2));
+	bool ok = sizeof(VRefSmall) <= VIRTUAL_REF_INLINE_SIZE && sizeof(VRefBig) > VIRTUAL_REF_INLINE_SIZE
+		&& small->kind() == 1 && big->kind() == 2;
+	{
+		//copies of references with and without a local object
+		Ref<VRefBase, true> c1 = small;
+		Ref<VRefBase, true> c2 = big;
+		Ref<VRefBase, true> c3(small.GetObjectId());
+		Ref<VRefBase, true> c4 = c3;
+		ok = ok && c1->kind() == 1 && c2->kind() == 2 && c4->kind() == 1;
+		//assignments between the classes, to itself and to a null reference
+		c1 = big;
+		c2 = small;
+		Ref<VRefBase, true>& same = c3;
+		c3 = same;
+		ok = ok && c1->kind() == 2 && c2->kind() == 1 && c3->kind() == 1;
+		c4 = Ref<VRefBase, true>((ObjectKey)0);
+		ok = ok && !c4;
+	}
+	//the copies are destroyed, and the originals are still usable
+	ok = ok && small->kind() == 1 && big->kind() == 2 && small->v == 1 && big->v == 2;
+	std::cout << (ok ? "VREF OK" : "VREF ERR") << std::endl;
+}
+
+//the words of proto_arr, and the first words of the regions written before the event, the semaphore and the thread pool
+#define PROTO_SIZE 1024
+#define PROTO_EVENT 0
+#define PROTO_SEM 256
+#define PROTO_POOL 512
+DefGlobal(proto_arr, Array<int>);
+DefGlobal(proto_bad, Array<int>);
+DefGlobal(proto_nodes, int);
+DefGlobal(proto_barrier, Ref<DBarrier>);
+DefGlobal(proto_event, Ref<DEvent>);
+DefGlobal(proto_sem, Ref<DSemaphore>);
+
+//the number of words of [start, start+len) not equal to f(i), read one by one and as one chunk (a batch of misses)
+template<typename F>
+int protocheck(uint32_t start, uint32_t len, F f)
+{
+	std::vector<int> buf(len);
+	proto_arr->CopyTo(buf.data(), start, len);
+	int bad = 0;
+	for (uint32_t i = start; i < start + len; i++)
+	{
+		if (proto_arr[i] != f(i) || buf[i - start] != f(i))
+			bad++;
+	}
+	return bad;
+}
+
+//run on each node: read the words the other nodes wrote before a barrier, an event and a semaphore
+void protoproc(uint32_t p)
+{
+	const uint32_t nodes = proto_nodes;
+	int bad = 0;
+	//the first round writes single words, so that every block has a writer on each node. The second writes one chunk per node
+	for (int round = 1; round <= 2; round++)
+	{
+		if (round == 1)
+		{
+			for (uint32_t i = p; i < PROTO_SIZE; i += nodes)
+				proto_arr[i] = i * 10 + round;
+		}
+		else
+		{
+			uint32_t start = p * (PROTO_SIZE / nodes);
+			uint32_t len = (p == nodes - 1) ? PROTO_SIZE - start : PROTO_SIZE / nodes;
+			std::vector<int> buf(len);
+			for (uint32_t k = 0; k < len; k++)
+				buf[k] = (start + k) * 10 + round;
+			proto_arr->CopyFrom(buf.data(), start, len);
+		}
+		proto_barrier->Enter();
+		bad += protocheck(0, PROTO_SIZE, [round](uint32_t i) { return (int)i * 10 + round; });
+		proto_barrier->Enter();
+	}
+	//every node has cached all the blocks by now, so the later writes reach them as renews or invalidations
+	if (nodes > 1 && p == 0)
+	{
+		for (uint32_t i = PROTO_EVENT; i < PROTO_SEM; i++)
+			proto_arr[i] = -(int)i;
+		proto_event->Set();
+		for (uint32_t n = 1; n < nodes; n++)
+			proto_sem->Acquire();
+		bad += protocheck(PROTO_SEM, PROTO_POOL - PROTO_SEM, [](uint32_t i) { return (int)i * 7; });
+	}
+	else if (nodes > 1)
+	{
+		proto_event->Wait();
+		bad += protocheck(PROTO_EVENT, PROTO_SEM - PROTO_EVENT, [](uint32_t i) { return -(int)i; });
+		for (uint32_t i = PROTO_SEM + p - 1; i < PROTO_POOL; i += nodes - 1)
+			proto_arr[i] = i * 7;
+		proto_sem->Release();
+	}
+	proto_bad[p] = bad;
+}
+RegFunc(protoproc);
+
+//the writes published at each release point are seen after the matching acquire, whatever the cache mode is (see main_protocol)
+void protocoltest()
+{
+	const uint32_t nodes = DogeeEnv::num_nodes > 1 ? DogeeEnv::num_nodes : 1;
+	proto_nodes = nodes;
+	proto_arr = NewArray<int>(PROTO_SIZE);
+	proto_bad = NewArray<int>(nodes);
+	proto_barrier = NewObj<DBarrier>(nodes);
+	proto_event = NewObj<DEvent>(false, false);
+	proto_sem = NewObj<DSemaphore>(0);
+	std::vector<Ref<DThread>> threads;
+	for (uint32_t p = 1; p < nodes; p++)
+		threads.push_back(NewObj<DThread>(protoproc, p, p));
+	protoproc(0);
+	for (auto& th : threads)
+		th->Join();
+	int bad = 0;
+	for (uint32_t p = 0; p < nodes; p++)
+		bad += proto_bad[p];
+	//each closure writes a block, published when it completes
+	DThreadPool* pool = DogeeEnv::ThreadPoolConfig::thread_pool;
+	if (pool)
+	{
+		std::vector<DThreadPool::DThreadPoolEvent> events;
+		const uint32_t first = PROTO_POOL;
+		for (uint32_t j = 0; j < (PROTO_SIZE - PROTO_POOL) / DSM_CACHE_BLOCK_SIZE; j++)
+		{
+			events.push_back(pool->submit([first](uint32_t j) {
+				for (uint32_t k = 0; k < DSM_CACHE_BLOCK_SIZE; k++)
+					proto_arr[first + j * DSM_CACHE_BLOCK_SIZE + k] = (int)(j * 1000 + k);
+			}, j));
+		}
+		for (auto& e : events)
+			e.Wait(-1);
+		bad += protocheck(PROTO_POOL, PROTO_SIZE - PROTO_POOL, [](uint32_t i) {
+			uint32_t j = (i - PROTO_POOL) / DSM_CACHE_BLOCK_SIZE;
+			return (int)(j * 1000 + (i - PROTO_POOL) % DSM_CACHE_BLOCK_SIZE);
+		});
+	}
+	DelArray<int>(proto_arr);
+	DelArray<int>(proto_bad);
+	if (bad)
+	{
+		std::cout << "PROTOCOL ERR " << bad << std::endl;
+		return;
+	}
+	std::cout << "PROTOCOL OK" << std::endl;
+}
+
 void fieldtest()
 {
 	writetest<int>();
@@ -247,6 +784,18 @@ void fieldtest()
 	singlewritetest<double>();
 	singlewritetest<long long>();
 
+	readonlytest<int>();
+	readonlytest<double>();
+	structtest();
+	packedtest();
+	snapshottest();
+	viewtest();
+	layouttest();
+	partitiontest();
+	spantest();
+	vreftest();
+	protocoltest();
+
 	clsaa AAA(0);
 	std::cout << AAA.i.GetFieldId() << std::endl
 		<< AAA.arr.GetFieldId() << std::endl
@@ -436,6 +985,38 @@ int main_functional(int argc, char* argv[])
 ////////////////////////Dthread pool test end
 
 
+/*
+Run protocoltest under the cache mode named by DOGEE_TEST_MODE, which
+every node of the test should have in its environment: multiwriter,
+migrate, combine, invalidate or adaptive, or the update protocol if it is
+not set. The chunk reads and writes of the test are batched misses in
+every mode.
+*/
+int main_protocol(int argc, char* argv[])
+{
+	const char* env = getenv("DOGEE_TEST_MODE");
+	std::string mode = env ? env : "update";
+	if (mode == "multiwriter")
+		DogeeEnv::CacheConfig::multiple_writers = true;
+	else if (mode == "migrate")
+	{
+		DogeeEnv::CacheConfig::home_owned_blocks = true;
+		DogeeEnv::CacheConfig::migrate_writes = 2;
+	}
+	else if (mode == "combine")
+		DogeeEnv::CacheConfig::write_combining = true;
+	else if (mode == "invalidate")
+		DogeeEnv::CacheConfig::coherence = DogeeEnv::CacheConfig::CoherenceInvalidate;
+	else if (mode == "adaptive")
+		DogeeEnv::CacheConfig::coherence = DogeeEnv::CacheConfig::CoherenceAdaptive;
+	DogeeEnv::ThreadPoolConfig::thread_pool_count = 2;
+	HelperInitCluster(argc, argv);
+	std::cout << "PROTOCOL MODE " << mode << std::endl;
+	protocoltest();
+	CloseCluster();
+	return 0;
+}
+
 int main2(int argc, char* argv[])
 {
 	if (argc == 3 && std::string(argv[1]) == "-s")
@@ -39,8 +39,8 @@ typedef  HANDLE ProcessIdentifier;
 #define UaEnterWriteRWLock(a) pthread_rwlock_wrlock(a)
 #define UaLeaveWriteRWLock(a) pthread_rwlock_unlock(a)
 #define UaEnterReadRWLock(a) pthread_rwlock_rdlock(a)
-#define UaTryEnterWriteRWLock(a) pthread_rwlock_trywrlock(a)
-#define UaTryEnterReadRWLock(a) pthread_rwlock_tryrdlock(a)
+#define UaTryEnterWriteRWLock(a) (pthread_rwlock_trywrlock(a)==0)
+#define UaTryEnterReadRWLock(a) (pthread_rwlock_tryrdlock(a)==0)
 #define UaLeaveReadRWLock(a) pthread_rwlock_unlock(a)
 #define UaKillRWLock(a) pthread_rwlock_destroy(a)
 #define UaWaitForProcess(a) waitpid(a,NULL,0)
@@ -0,0 +1,411 @@
+#ifndef __DOGEE_ARRAY_VIEW_H_
+#define __DOGEE_ARRAY_VIEW_H_
+
+#include "DogeeBase.h"
+#include "DogeeThreadPool.h"
+#include <iterator>
+#include <future>
+
+namespace Dogee
+{
+	//the threads fetching the next windows of the array views, nullptr if disabled
+	extern LThreadPool* ArrayViewPrefetcher();
+
+	/*
+	The local element type of an array and the number of its elements in
+	"words" words of the DSM
+	*/
+	template<typename T> struct ArrayViewTraits
+	{
+		typedef T value_type;
+		static uint32_t elements(uint32_t words)
+		{
+			return words / DSMInterface<T>::dsm_size_of;
+		}
+	};
+
+	template<typename T> class ArrayViewWindow
+	{
+	public:
+		typedef typename ArrayViewTraits<T>::value_type E;
+	private:
+		Array<T> arr;
+		uint32_t start;
+		uint32_t len;
+		uint32_t window;
+		bool streaming;
+		/*
+		the window of the elements [base, base+n) of the view. "dirty" has a
+		bit for each written element, all of them in [dirty_lo, dirty_hi)
+		*/
+		std::unique_ptr<E[]> buf;
+		uint32_t base;
+		uint32_t n;
+		std::unique_ptr<uint32_t[]> dirty;
+		uint32_t dirty_lo;
+		uint32_t dirty_hi;
+		//the window being fetched by the prefetcher
+		std::unique_ptr<E[]> next;
+		uint32_t next_base;
+		bool has_pending;
+		std::future<int> pending;
+
+		uint32_t window_len(uint32_t wbase)
+		{
+			return len - wbase < window ? len - wbase : window;
+		}
+
+		void prefetch(uint32_t wbase)
+		{
+			LThreadPool* pool = ArrayViewPrefetcher();
+			if (!pool)
+				return;
+			Array<T> a = arr;
+			E* dst = next.get();
+			uint32_t from = start + wbase;
+			uint32_t cnt = window_len(wbase);
+			bool stream = streaming;
+			auto task = [a, dst, from, cnt, stream]()
+			{
+				DogeeEnv::InitCurrentThread();
+				a.CopyTo(dst, from, cnt, stream);
+				return 0;
+			};
+			pending = pool->submit(task);
+			next_base = wbase;
+			has_pending = true;
+		}
+
+		//make the window hold the element "idx" of the view
+		void seek(uint32_t idx)
+		{
+			Flush();
+			uint32_t wbase = idx / window * window;
+			bool forward = (wbase >= base);
+			if (has_pending)
+			{
+				pending.wait();
+				has_pending = false;
+			}
+			if (next_base == wbase && next)
+			{
+				buf.swap(next);
+			}
+			else
+			{
+				if (!buf)
+					buf.reset(new E[window]);
+				arr.CopyTo(buf.get(), start + wbase, window_len(wbase), streaming);
+			}
+			next_base = len;
+			base = wbase;
+			n = window_len(wbase);
+			//fetch the window after this one in the direction of the accesses
+			if (len > window)
+			{
+				if (!next)
+					next.reset(new E[window]);
+				if (forward && wbase + window < len)
+					prefetch(wbase + window);
+				else if (!forward && wbase >= window)
+					prefetch(wbase - window);
+			}
+		}
+	public:
+		ArrayViewWindow(Array<T> arr, uint32_t start, uint32_t len, bool streaming)
+			: arr(arr), start(start), len(len), streaming(streaming), base(0), n(0),
+			dirty_lo(0), dirty_hi(0), next_base(len), has_pending(false)
+		{
+			window = ArrayViewTraits<T>::elements(DogeeEnv::CacheConfig::view_window);
+			if (window == 0)
+				window = 1;
+			dirty.reset(new uint32_t[(window + 31) / 32]());
+		}
+		~ArrayViewWindow()
+		{
+			Flush();
+			if (has_pending)
+				pending.wait();
+		}
+
+		uint32_t size()
+		{
+			return len;
+		}
+
+		E read(uint32_t idx)
+		{
+			if (idx - base >= n)
+				seek(idx);
+			return buf[idx - base];
+		}
+
+		void write(uint32_t idx, const E& v)
+		{
+			if (idx - base >= n)
+				seek(idx);
+			uint32_t i = idx - base;
+			buf[i] = v;
+			dirty[i / 32] |= 1u << (i % 32);
+			if (dirty_lo == dirty_hi)
+			{
+				dirty_lo = i;
+				dirty_hi = i + 1;
+			}
+			else
+			{
+				dirty_lo = i < dirty_lo ? i : dirty_lo;
+				dirty_hi = i + 1 > dirty_hi ? i + 1 : dirty_hi;
+			}
+		}
+
+		void Flush()
+		{
+			if (dirty_lo == dirty_hi)
+				return;
+			//write back each run of written elements, so the elements between them are not overwritten
+			uint32_t i = dirty_lo;
+			while (i < dirty_hi)
+			{
+				if (!(dirty[i / 32] & (1u << (i % 32))))
+				{
+					i++;
+					continue;
+				}
+				uint32_t run = i;
+				while (i < dirty_hi && (dirty[i / 32] & (1u << (i % 32))))
+				{
+					dirty[i / 32] &= ~(1u << (i % 32));
+					i++;
+				}
+				arr.CopyFrom(buf.get() + run, start + base + run, i - run, streaming);
+			}
+			dirty_lo = dirty_hi = 0;
+		}
+	};
+
+	//an element of an ArrayView, like ArrayElement
+	template<typename T> class ArrayViewElement
+	{
+	private:
+		typedef typename ArrayViewTraits<T>::value_type E;
+		ArrayViewWindow<T>* w;
+		uint32_t idx;
+	public:
+		ArrayViewElement(ArrayViewWindow<T>* w, uint32_t idx) : w(w), idx(idx)
+		{
+		}
+
+		//read
+		operator E() const
+		{
+			return w->read(idx);
+		}
+
+		//write
+		E operator=(const E& x)
+		{
+			w->write(idx, x);
+			return x;
+		}
+
+		//copy
+		ArrayViewElement<T>& operator=(const ArrayViewElement<T>& x)
+		{
+			w->write(idx, x.w->read(x.idx));
+			return *this;
+		}
+
+		friend void swap(ArrayViewElement<T> a, ArrayViewElement<T> b)
+		{
+			E tmp = a;
+			a = b;
+			b = tmp;
+		}
+	};
+
+	template<typename T, bool is_const> class ArrayViewIterator
+	{
+	public:
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef typename ArrayViewTraits<T>::value_type value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef void pointer;
+		typedef typename std::conditional<is_const, value_type, ArrayViewElement<T>>::type reference;
+	private:
+		ArrayViewWindow<T>* w;
+		uint32_t idx;
+	public:
+		ArrayViewIterator() : w(nullptr), idx(0)
+		{
+		}
+		ArrayViewIterator(ArrayViewWindow<T>* w, uint32_t idx) : w(w), idx(idx)
+		{
+		}
+		operator ArrayViewIterator<T, true>() const
+		{
+			return ArrayViewIterator<T, true>(w, idx);
+		}
+
+		reference operator*() const
+		{
+			return reference(ArrayViewElement<T>(w, idx));
+		}
+		reference operator[](difference_type k) const
+		{
+			return *(*this + k);
+		}
+
+		ArrayViewIterator& operator++()
+		{
+			idx++;
+			return *this;
+		}
+		ArrayViewIterator operator++(int)
+		{
+			ArrayViewIterator ret = *this;
+			idx++;
+			return ret;
+		}
+		ArrayViewIterator& operator--()
+		{
+			idx--;
+			return *this;
+		}
+		ArrayViewIterator operator--(int)
+		{
+			ArrayViewIterator ret = *this;
+			idx--;
+			return ret;
+		}
+		ArrayViewIterator& operator+=(difference_type k)
+		{
+			idx = (uint32_t)(idx + k);
+			return *this;
+		}
+		ArrayViewIterator& operator-=(difference_type k)
+		{
+			idx = (uint32_t)(idx - k);
+			return *this;
+		}
+		ArrayViewIterator operator+(difference_type k) const
+		{
+			return ArrayViewIterator(w, (uint32_t)(idx + k));
+		}
+		friend ArrayViewIterator operator+(difference_type k, const ArrayViewIterator& x)
+		{
+			return x + k;
+		}
+		ArrayViewIterator operator-(difference_type k) const
+		{
+			return ArrayViewIterator(w, (uint32_t)(idx - k));
+		}
+		difference_type operator-(const ArrayViewIterator& x) const
+		{
+			return (difference_type)idx - (difference_type)x.idx;
+		}
+
+		bool operator==(const ArrayViewIterator& x) const
+		{
+			return idx == x.idx;
+		}
+		bool operator!=(const ArrayViewIterator& x) const
+		{
+			return idx != x.idx;
+		}
+		bool operator<(const ArrayViewIterator& x) const
+		{
+			return idx < x.idx;
+		}
+		bool operator>(const ArrayViewIterator& x) const
+		{
+			return idx > x.idx;
+		}
+		bool operator<=(const ArrayViewIterator& x) const
+		{
+			return idx <= x.idx;
+		}
+		bool operator>=(const ArrayViewIterator& x) const
+		{
+			return idx >= x.idx;
+		}
+	};
+
+	/*
+	A random-access range over the elements [start, start+len) of an
+	array, made by Array::view. The elements are read a window of
+	DogeeEnv::CacheConfig::view_window words at a time with one chunk
+	access, and the next window in the direction of the accesses is
+	fetched in the background while the current one is used. The writes
+	stay in the window, and each run of written elements is written back
+	with one chunk access when the window moves, on Flush() and when the
+	last copy of the view is destroyed. The elements not written through
+	the view are left as they are. Call Flush() before the writes should
+	be seen by other threads (e.g. before a barrier).
+	A view and its iterators should only be used by one thread, and the
+	iterators should not outlive the view. Iterating a const view does not
+	mark the elements written.
+	*/
+	template<typename T> class ArrayView
+	{
+	public:
+		typedef typename ArrayViewTraits<T>::value_type value_type;
+		typedef ArrayViewIterator<T, false> iterator;
+		typedef ArrayViewIterator<T, true> const_iterator;
+	private:
+		std::shared_ptr<ArrayViewWindow<T>> w;
+	public:
+		ArrayView(Array<T> arr, uint32_t start, uint32_t len, bool streaming = false)
+			: w(std::make_shared<ArrayViewWindow<T>>(arr, start, len, streaming))
+		{
+		}
+
+		uint32_t size() const
+		{
+			return w->size();
+		}
+
+		ArrayViewElement<T> operator[](uint32_t k) const
+		{
+			return ArrayViewElement<T>(w.get(), k);
+		}
+
+		iterator begin()
+		{
+			return iterator(w.get(), 0);
+		}
+		iterator end()
+		{
+			return iterator(w.get(), w->size());
+		}
+		const_iterator begin() const
+		{
+			return const_iterator(w.get(), 0);
+		}
+		const_iterator end() const
+		{
+			return const_iterator(w.get(), w->size());
+		}
+		const_iterator cbegin() const
+		{
+			return begin();
+		}
+		const_iterator cend() const
+		{
+			return end();
+		}
+
+		//write the modified elements of the window back
+		void Flush()
+		{
+			w->Flush();
+		}
+	};
+
+	template<typename T> ArrayView<T> Array<T>::view(uint32_t start_index, uint32_t len, bool streaming) const
+	{
+		return ArrayView<T>(*this, start_index, len, streaming);
+	}
+}
+
+#endif
@@ -6,30 +6,57 @@
 //#include "hash_compatible.h"
 #include <unordered_map>
 #include <functional>
+#include <type_traits>
+#include <vector>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <string.h>
 #include "Dogee.h"
 #include "DogeeEnv.h"
 #include "DogeeStorage.h"
 #include "DogeeUtil.h"
 
+//the max number of words packed by one chunk access of Array::CopyTo/CopyFrom
+#define ARRAY_COPY_WORDS (DSM_CACHE_BLOCK_SIZE * 64)
+//the max size of a local object a virtual reference holds without a heap allocation
+#define VIRTUAL_REF_INLINE_SIZE 64
+
 namespace Dogee
 {
 	int SetSlaveInitProc(void(*)(uint32_t));
 	template <class T> struct AutoRegisterObject;
+
+	/*
+	A local copy of the first words of a shared object, made by
+	Ref::Fetch(). The fields of an object with a shadow are read from and
+	written to the shadow, and "dirty" marks the words written
+	*/
+	struct ObjectShadow
+	{
+		std::vector<uint32_t> words;
+		std::vector<bool> dirty;
+	};
+
 	class DObject
 	{
 	protected:
 		static const int _LAST_ = 0;
 	private:
 		ObjectKey object_id;
+		//shared by the copies of the reference
+		std::shared_ptr<ObjectShadow> shadow;
 	public:
 		//test code
 		ObjectKey GetObjectId()
 		{
 			return object_id;
 		}
+		//a shadow of the old object is discarded
 		void SetObjectId(ObjectKey ok)
 		{
 			object_id = ok;
+			shadow.reset();
 		}
 		explicit DObject(ObjectKey obj_id)
 		{
@@ -38,32 +65,101 @@ namespace Dogee
 
 		void Destroy(){}
 
+		ObjectShadow* GetShadow()
+		{
+			return shadow.get();
+		}
+
+		//read the first "len" words of the object into a new shadow (see Ref::Fetch)
+		void FetchFields(uint32_t len)
+		{
+			shadow = std::make_shared<ObjectShadow>();
+			shadow->words.resize(len);
+			shadow->dirty.assign(len, false);
+			if (len)
+				DogeeEnv::cache->getchunk(object_id, 0, len, shadow->words.data());
+		}
+
+		//write the dirty words of the shadow back and drop the shadow
+		void CommitFields()
+		{
+			if (!shadow)
+				return;
+			std::shared_ptr<ObjectShadow> s = shadow;
+			shadow.reset();
+			uint32_t len = (uint32_t)s->words.size();
+			uint32_t i = 0;
+			while (i < len)
+			{
+				if (!s->dirty[i])
+				{
+					i++;
+					continue;
+				}
+				uint32_t start = i;
+				while (i < len && s->dirty[i])
+					i++;
+				DogeeEnv::cache->putchunk(object_id, start, i - start, s->words.data() + start);
+			}
+		}
 
+		void DiscardFields()
+		{
+			shadow.reset();
+		}
 	};
 	extern THREAD_LOCAL DObject* lastobject;
 
-	typedef  std::function<DObject*(ObjectKey)> VirtualReferenceCreator;
+	/*
+	How a virtual reference makes the local object of a class. "create"
+	constructs it in "mem", which has at least "size" bytes, or on the
+	heap if "mem" is nullptr. "destroy" destructs an object made by
+	"create", and frees it if it is on the heap
+	*/
+	struct VirtualClassInfo
+	{
+		DObject* (*create)(ObjectKey key, void* mem);
+		void (*destroy)(DObject* obj, bool on_heap);
+		size_t size;
+	};
 
-	inline std::unordered_map<unsigned, VirtualReferenceCreator>& GetClassMap()
+	inline std::unordered_map<unsigned, VirtualClassInfo>& GetClassMap()
 	{
-		static std::unordered_map<unsigned, VirtualReferenceCreator> VirtualReferenceCreators;
-		return VirtualReferenceCreators;
+		static std::unordered_map<unsigned, VirtualClassInfo> VirtualClassInfos;
+		return VirtualClassInfos;
 	}
 
-	inline void RegisterClass(unsigned cls_id, VirtualReferenceCreator  func)
+	inline void RegisterClass(unsigned cls_id, const VirtualClassInfo& info)
 	{
-		GetClassMap()[cls_id] = func;
+		GetClassMap()[cls_id] = info;
 	}
 
-	inline VirtualReferenceCreator& GetClassById(unsigned cls_id)
+	//nullptr if the class is not registered
+	inline const VirtualClassInfo* GetClassById(unsigned cls_id)
 	{
-		return GetClassMap()[cls_id];
+		auto itr = GetClassMap().find(cls_id);
+		return itr == GetClassMap().end() ? nullptr : &itr->second;
 	}
 
 	template<class T> T currentClassDummy();
 
+	//the position of a field in its class, counted from DefBegin (see DogeeMacro.h)
+	template<int N> struct FieldIndex : FieldIndex<N - 1>
+	{
+	};
+	template<> struct FieldIndex<0>
+	{
+	};
+	//the end of the fields of the parent class
+	template<int End> struct FieldEnd
+	{
+		static const int end = End;
+	};
+
 	template<class T, bool isVirtual = false> class Ref;
 	template<typename T> class Array;
+	template<typename T> class ArrayView;
+	template<typename T> class LocalSpan;
 
 	template <typename T>
 	struct DogeeTrait {
@@ -78,18 +174,40 @@ namespace Dogee
 	template <typename T>
 	class DSMInterface
 	{
+		/*
+		Other types take ceil(size/4) words, the last word padded with 0s.
+		An element is read or written by one chunk access
+		*/
 		template <typename T2,int size>
 		struct Helper
 		{
-			static const int dsm_size_of = 1;
+			static_assert(std::is_trivially_copyable<T2>::value, "the field/array element should be trivially copyable");
+			static const int dsm_size_of = (size + 3) / 4;
 			static T2 get(ObjectKey obj_id, FieldKey field_id)
 			{
-				static_assert(size==4 || size==8, "the size of the field/array element is not 4 or 8");
-				return *(T*)nullptr;
+				uint32_t buf[dsm_size_of];
+				DogeeEnv::cache->getchunk(obj_id, field_id, dsm_size_of, buf);
+				T2 ret;
+				memcpy(&ret, buf, sizeof(T2));
+				return ret;
 			}
 			static void set(ObjectKey obj_id, FieldKey field_id, T2 val)
 			{
-				static_assert(size == 4 || size == 8, "the size of the field/array element is not 4 or 8");
+				uint32_t buf[dsm_size_of];
+				buf[dsm_size_of - 1] = 0;
+				memcpy(buf, &val, sizeof(T2));
+				DogeeEnv::cache->putchunk(obj_id, field_id, dsm_size_of, buf);
+			}
+			static T2 load(const uint32_t* words)
+			{
+				T2 ret;
+				memcpy(&ret, words, sizeof(T2));
+				return ret;
+			}
+			static void store(T2 val, uint32_t* words)
+			{
+				words[dsm_size_of - 1] = 0;
+				memcpy(words, &val, sizeof(T2));
 			}
 		};
 		template <typename T2>
@@ -104,6 +222,14 @@ namespace Dogee
 			{
 				DogeeEnv::cache->put(obj_id, field_id, trunc_cast<uint32_t>(val));
 			}
+			static T2 load(const uint32_t* words)
+			{
+				return trunc_cast<T2>(words[0]);
+			}
+			static void store(T2 val, uint32_t* words)
+			{
+				words[0] = trunc_cast<uint32_t>(val);
+			}
 		};
 		template <typename T2>
 		struct Helper<T2, 8>
@@ -119,6 +245,16 @@ namespace Dogee
 			{
 				DogeeEnv::cache->put(obj_id, field_id, trunc_cast<uint64_t>(val));
 			}
+			static T2 load(const uint32_t* words)
+			{
+				T2 ret;
+				memcpy(&ret, words, sizeof(T2));
+				return ret;
+			}
+			static void store(T2 val, uint32_t* words)
+			{
+				memcpy(words, &val, sizeof(T2));
+			}
 		};
 	public:
 		static const int dsm_size_of = Helper<T, sizeof(T)>::dsm_size_of;
@@ -134,6 +270,16 @@ namespace Dogee
 			Helper<T, sizeof(T)>::set(obj_id, field_id, val);
 		}
 
+		//read and write a value in a local copy of the words (see ObjectShadow)
+		static T load(const uint32_t* words)
+		{
+			return Helper<T, sizeof(T)>::load(words);
+		}
+		static void store(T val, uint32_t* words)
+		{
+			Helper<T, sizeof(T)>::store(val, words);
+		}
+
 	};
 
 
@@ -153,6 +299,15 @@ namespace Dogee
 		{
 			DogeeEnv::cache->put(obj_id, field_id, val.GetObjectId());
 		}
+		static Ref<T, isVirtual> load(const uint32_t* words)
+		{
+			Ref<T, isVirtual> ret(words[0]);
+			return ret;
+		}
+		static void store(Ref<T, isVirtual> val, uint32_t* words)
+		{
+			words[0] = val.GetObjectId();
+		}
 
 	};
 
@@ -172,19 +327,40 @@ namespace Dogee
 		{
 			DogeeEnv::cache->put(obj_id, field_id,val.GetObjectId());
 		}
+		static Array<T> load(const uint32_t* words)
+		{
+			return Array<T>(words[0]);
+		}
+		static void store(Array<T> val, uint32_t* words)
+		{
+			words[0] = val.GetObjectId();
+		}
 
 	};
-	inline uint32_t GetClassId(ObjectKey obj_id)
-	{
-		uint32_t ret,size;
-		DogeeEnv::backend->getinfo(obj_id, ret, size);
-		return ret;
-	}
+	/*
+	The class id of an object. The ids of the objects allocated on this
+	node and of the objects already looked up are kept in a node-local
+	cache, so only the first lookup of an object from another node asks
+	the backend. The id of a deleted object is dropped from the cache of
+	the node deleting it.
+	*/
+	extern uint32_t GetClassId(ObjectKey obj_id);
 /*	inline void SetClassId(ObjectKey obj_id, int cls_id)
 	{
 		//test code
 		DogeeEnv::cache->put(obj_id, 97, cls_id);
 	}*/
+	/*
+	A field of type T placed after the fields ending at word "Prev". The
+	fields of more than one word start at even words, so that an 8-byte
+	value does not cross a cache block
+	*/
+	template<int Prev, typename T> struct FieldSlot
+	{
+		static const int offset = DSMInterface<T>::dsm_size_of >= 2 ? (Prev + 1) / 2 * 2 : Prev;
+		static const int end = offset + DSMInterface<T>::dsm_size_of;
+	};
+
 	template<typename T> class BaseArrayElement
 	{
 	private:
@@ -229,7 +405,7 @@ namespace Dogee
 		{
 			return get();
 		}
-		decltype(getarray(T(0), 0)) operator[](int k)
+		decltype(getarray(std::declval<T>(), 0)) operator[](int k)
 		{
 			return getarray(get(), k);
 		}
@@ -298,7 +474,10 @@ namespace Dogee
 		T get()
 		{
 			assert(lastobject != nullptr);// "You should use a Ref<T> to access the member"
-			T ret = DSMInterface<T>::get_value(lastobject->GetObjectId(), FieldId);
+			ObjectShadow* shadow = lastobject->GetShadow();
+			T ret = (shadow && FieldId + DSMInterface<T>::dsm_size_of <= shadow->words.size()) ?
+				DSMInterface<T>::load(shadow->words.data() + FieldId) :
+				DSMInterface<T>::get_value(lastobject->GetObjectId(), FieldId);
 #ifdef DOGEE_DBG
 			lastobject = nullptr;
 #endif
@@ -319,7 +498,15 @@ namespace Dogee
 		BaseValue<T, FieldId>& operator=(T x)
 		{
 			assert(lastobject != nullptr);// "You should use a Ref<T> to access the member"
-			DSMInterface<T>::set_value(lastobject->GetObjectId(), FieldId, x);
+			ObjectShadow* shadow = lastobject->GetShadow();
+			if (shadow && FieldId + DSMInterface<T>::dsm_size_of <= shadow->words.size())
+			{
+				DSMInterface<T>::store(x, shadow->words.data() + FieldId);
+				for (int i = 0; i < DSMInterface<T>::dsm_size_of; i++)
+					shadow->dirty[FieldId + i] = true;
+			}
+			else
+				DSMInterface<T>::set_value(lastobject->GetObjectId(), FieldId, x);
 #ifdef DOGEE_DBG
 			lastobject = nullptr;
 #endif
@@ -370,37 +557,91 @@ namespace Dogee
 	{
 	private:
 		// this is a template to check the type of the array - whether it
-		// supports array copy operation
-		template<typename T2, int n> struct Copyer
-		{
-			static uint32_t* CopyType(T2* ptr){ abort(); return nullptr; }//unsupported type of array is found
-		};
-
-		template<typename T2> struct Copyer<T2, 4>
-		{
-			static uint32_t* CopyType(T2* ptr){ return (uint32_t*)ptr; }
-		};
-		template<typename T2> struct Copyer<T2, 8>
-		{
-			static uint64_t* CopyType(T2* ptr){ return (uint64_t*)ptr; }
-		};
-
-		// We should be careful here. If Dogee::Ref<T,false> happens to have only one
-		// member, which is of size 4 bytes, then sizeof(Dogee::Ref<T,false>) happens to be 4.
-		// So we can use a uint32_t array to represent a Dogee::Ref<T,false> array.
-		// However, when using Array<Dogee::Ref<T,true>>, we have to mannually construct
-		// each reference for the virtual table. We don't support Ref<T,true> here.
-		template<typename T2> struct Copyer<Ref<T2, false>, 4>
-		{
-			static uint32_t* CopyType(Ref<T2, false>* ptr){ return (uint32_t*)ptr; }
+		// supports array copy operation. An element of dsm_size_of words
+		// whose local size is the same is copied in place. Other elements
+		// (e.g. a 6-byte struct) are packed to words in a buffer.
+		// Dogee::Array happens to have only one member, which is of size 4
+		// bytes, so it is copied in place.
+		template<typename T2> struct Copyer
+		{
+			static_assert(sizeof(T2) <= DSMInterface<T2>::dsm_size_of * sizeof(uint32_t), "the type of the array does not support array copy");
+			typedef std::integral_constant<bool, sizeof(T2) == DSMInterface<T2>::dsm_size_of * sizeof(uint32_t)> in_place;
+			static void CopyTo(ObjectKey object_id, T2* localarr, uint32_t start_index, uint32_t copy_len)
+			{
+				CopyTo(object_id, localarr, start_index, copy_len, in_place());
+			}
+			static void CopyFrom(ObjectKey object_id, T2* localarr, uint32_t start_index, uint32_t copy_len)
+			{
+				CopyFrom(object_id, localarr, start_index, copy_len, in_place());
+			}
+			static void CopyTo(ObjectKey object_id, T2* localarr, uint32_t start_index, uint32_t copy_len, std::true_type)
+			{
+				const uint32_t size_of = DSMInterface<T2>::dsm_size_of;
+				DogeeEnv::cache->getchunk(object_id, start_index * size_of, copy_len * size_of, (uint32_t*)localarr);
+			}
+			static void CopyFrom(ObjectKey object_id, T2* localarr, uint32_t start_index, uint32_t copy_len, std::true_type)
+			{
+				const uint32_t size_of = DSMInterface<T2>::dsm_size_of;
+				DogeeEnv::cache->putchunk(object_id, start_index * size_of, copy_len * size_of, (uint32_t*)localarr);
+			}
+			//the buffered copies are only instantiated for the elements not copied in place, which are trivially copyable
+			static void CopyTo(ObjectKey object_id, T2* localarr, uint32_t start_index, uint32_t copy_len, std::false_type)
+			{
+				const uint32_t size_of = DSMInterface<T2>::dsm_size_of;
+				uint32_t step = copy_len < ARRAY_COPY_WORDS / size_of ? copy_len : (ARRAY_COPY_WORDS / size_of > 0 ? ARRAY_COPY_WORDS / size_of : 1);
+				std::vector<uint32_t> buf(step * size_of);
+				for (uint32_t i = 0; i < copy_len; i += step)
+				{
+					uint32_t n = copy_len - i < step ? copy_len - i : step;
+					DogeeEnv::cache->getchunk(object_id, (start_index + i) * size_of, n * size_of, buf.data());
+					for (uint32_t j = 0; j < n; j++)
+						memcpy(localarr + i + j, buf.data() + j * size_of, sizeof(T2));
+				}
+			}
+			static void CopyFrom(ObjectKey object_id, T2* localarr, uint32_t start_index, uint32_t copy_len, std::false_type)
+			{
+				const uint32_t size_of = DSMInterface<T2>::dsm_size_of;
+				uint32_t step = copy_len < ARRAY_COPY_WORDS / size_of ? copy_len : (ARRAY_COPY_WORDS / size_of > 0 ? ARRAY_COPY_WORDS / size_of : 1);
+				//the padding stays 0
+				std::vector<uint32_t> buf(step * size_of, 0);
+				for (uint32_t i = 0; i < copy_len; i += step)
+				{
+					uint32_t n = copy_len - i < step ? copy_len - i : step;
+					for (uint32_t j = 0; j < n; j++)
+						memcpy(buf.data() + j * size_of, localarr + i + j, sizeof(T2));
+					DogeeEnv::cache->putchunk(object_id, (start_index + i) * size_of, n * size_of, buf.data());
+				}
+			}
 		};
 
-		// We should be careful here. Dogee::Array happens to have only one
-		// member, which is of size 4 bytes. sizeof(Dogee::Array) happens to be 4.
-		// So we can use a uint32_t array to represent a Dogee::Array array.
-		template<typename T2> struct Copyer<Array<T2>, 4>
+		// A Dogee::Ref holds a local object with a virtual table, so we have
+		// to mannually construct each reference from the object key in the DSM.
+		template<typename T2, bool isVirtual> struct Copyer<Ref<T2, isVirtual>>
 		{
-			static uint32_t* CopyType(Array<T2>* ptr){ return (uint32_t*)ptr; }
+			static void CopyTo(ObjectKey object_id, Ref<T2, isVirtual>* localarr, uint32_t start_index, uint32_t copy_len)
+			{
+				uint32_t step = copy_len < ARRAY_COPY_WORDS ? copy_len : ARRAY_COPY_WORDS;
+				std::vector<uint32_t> buf(step);
+				for (uint32_t i = 0; i < copy_len; i += step)
+				{
+					uint32_t n = copy_len - i < step ? copy_len - i : step;
+					DogeeEnv::cache->getchunk(object_id, start_index + i, n, buf.data());
+					for (uint32_t j = 0; j < n; j++)
+						localarr[i + j] = Ref<T2, isVirtual>(buf[j]);
+				}
+			}
+			static void CopyFrom(ObjectKey object_id, Ref<T2, isVirtual>* localarr, uint32_t start_index, uint32_t copy_len)
+			{
+				uint32_t step = copy_len < ARRAY_COPY_WORDS ? copy_len : ARRAY_COPY_WORDS;
+				std::vector<uint32_t> buf(step);
+				for (uint32_t i = 0; i < copy_len; i += step)
+				{
+					uint32_t n = copy_len - i < step ? copy_len - i : step;
+					for (uint32_t j = 0; j < n; j++)
+						buf[j] = localarr[i + j].GetObjectId();
+					DogeeEnv::cache->putchunk(object_id, start_index + i, n, buf.data());
+				}
+			}
 		};
 		ObjectKey object_id;
 	public:
@@ -436,8 +677,10 @@ namespace Dogee
 		{
 			return (object_id != 0);
 		}
+		//Fill is a one-pass stream, so it does not allocate cache blocks (see DsmStreamingScope)
 		void Fill(std::function<T(uint32_t)> func, uint32_t start_index, uint32_t len) const
 		{
+			DsmStreamingScope scope;
 			const unsigned bsize = DSM_CACHE_BLOCK_SIZE * 8;
 			T blk[bsize];
 			for (unsigned i = 0; i < len / bsize; i++)
@@ -457,15 +700,23 @@ namespace Dogee
 
 		}
 
-		void CopyTo(T* localarr, uint32_t start_index, uint32_t copy_len) const
+		//if streaming is true, the copy does not allocate cache blocks (see DsmStreamingScope)
+		void CopyTo(T* localarr, uint32_t start_index, uint32_t copy_len, bool streaming = false) const
 		{
-			DogeeEnv::cache->getchunk(object_id, start_index, copy_len, Copyer<T, sizeof(T)>::CopyType(localarr));
+			DsmStreamingScope scope(streaming);
+			Copyer<T>::CopyTo(object_id, localarr, start_index, copy_len);
 		}
 
-		void CopyFrom(T* localarr, uint32_t start_index, uint32_t copy_len) const
+		void CopyFrom(T* localarr, uint32_t start_index, uint32_t copy_len, bool streaming = false) const
 		{
-			DogeeEnv::cache->putchunk(object_id, start_index, copy_len, Copyer<T, sizeof(T)>::CopyType(localarr));
+			DsmStreamingScope scope(streaming);
+			Copyer<T>::CopyFrom(object_id, localarr, start_index, copy_len);
 		}
+
+		//a random-access range of the elements [start_index, start_index+len), see DogeeArrayView.h
+		ArrayView<T> view(uint32_t start_index, uint32_t len, bool streaming = false) const;
+		//a local copy of the elements [start_index, start_index+len), written back at the release points, see DogeeLocalSpan.h
+		LocalSpan<T> MapLocal(uint32_t start_index, uint32_t len) const;
 	};
 
 
@@ -503,6 +754,27 @@ namespace Dogee
 			return obj.GetObjectId();
 		}
 
+		/*
+		Read all the fields of the object with one chunk access. Until
+		Commit() or Discard(), the field accesses through this reference
+		(and its copies) use the local copy, and do not see the writes of
+		other threads. Commit() writes the modified fields back, with one
+		chunk access for each run of modified words.
+		*/
+		void Fetch()
+		{
+			obj.FetchFields(T::_LAST_);
+		}
+		void Commit()
+		{
+			obj.CommitFields();
+		}
+		//drop the local copy and its modifications
+		void Discard()
+		{
+			obj.DiscardFields();
+		}
+
 		template <class T2>
 		Ref<T, false>& operator=(Ref<T2, false> x)
 		{
@@ -544,22 +816,60 @@ namespace Dogee
 	private:
 		T* pobj;
 		ObjectKey okey;
-		void RefObj(ObjectKey okey)
+		//the class of the object, known after the first get() or copied with the reference
+		const VirtualClassInfo* cls;
+		//the local object is made in "storage" if the class fits, or else on the heap
+		bool inplace;
+		typename std::aligned_storage<VIRTUAL_REF_INLINE_SIZE, alignof(std::max_align_t)>::type storage;
+		void RefObj()
 		{
 			if (okey == 0)
 			{
 				pobj = nullptr;
 				return;
 			}
-			std::function<DObject*(ObjectKey)> func = GetClassById(GetClassId(okey));
-			pobj = (T*)(func(okey)); //dynamic_cast<T*> (func(okey));
+			if (!cls)
+				cls = GetClassById(GetClassId(okey));
+			assert(cls);
+			inplace = (cls->size <= sizeof(storage));
+			pobj = (T*)(cls->create(okey, inplace ? &storage : nullptr)); //dynamic_cast<T*>
 			assert(pobj);
 		}
+		void Release()
+		{
+			if (pobj)
+			{
+				cls->destroy((DObject*)pobj, !inplace);
+				pobj = nullptr;
+			}
+		}
+		/*
+		The copies share the class, and the snapshot of the fields if the
+		local object is already made (see Ref<T, false>::Fetch)
+		*/
+		template <class T2>
+		void CopyRef(Ref<T2, true>& x)
+		{
+			okey = x.okey;
+			cls = x.cls;
+			if (x.pobj)
+			{
+				RefObj();
+				*(DObject*)pobj = *(DObject*)x.pobj;
+			}
+		}
+		template <class T2>
+		void CopyRef(Ref<T2, false>& x)
+		{
+			okey = x.GetObjectId();
+			cls = nullptr;
+		}
+		template<class T2, bool isV> friend class Ref;
 	public:
 		T* get()
 		{
 			if (!pobj) //fix-me : possible memory leak in multithreaded environment
-				RefObj(okey);
+				RefObj();
 			lastobject = (DObject*)pobj;
 			return pobj;
 		}
@@ -582,63 +892,117 @@ namespace Dogee
 			return okey;
 		}
 
+		//see Ref<T, false>::Fetch. The fields of the subclasses of T are not fetched
+		void Fetch()
+		{
+			get()->FetchFields(T::_LAST_);
+		}
+		void Commit()
+		{
+			if (pobj)
+				pobj->CommitFields();
+		}
+		void Discard()
+		{
+			if (pobj)
+				pobj->DiscardFields();
+		}
+
 		//copy or upcast
+		Ref<T, true>& operator=(const Ref<T, true>& x)
+		{
+			if (this != &x)
+			{
+				Release();
+				CopyRef(const_cast<Ref<T, true>&>(x));
+			}
+			return *this;
+		}
 		template <class T2, bool isVirtual>
 		Ref<T, true>& operator=(Ref<T2, isVirtual> x)
 		{
 			static_assert(std::is_base_of<T, T2>::value, "T2 should be subclass of T.");
-			okey = x.GetObjectId();
-			delete pobj;
-			pobj = nullptr;
+			Release();
+			CopyRef(x);
 			return *this;
 		}
 		template <class T2, bool isV>
-		Ref<T, false>& operator=(ArrayElement<Ref<T2, isV>>& x)
+		Ref<T, true>& operator=(ArrayElement<Ref<T2, isV>>& x)
 		{
 			static_assert(std::is_base_of<T, T2>::value, "T2 should be subclass of T.");
+			Release();
 			okey = x.get().GetObjectId();
-			delete pobj;
-			pobj = nullptr;
+			cls = nullptr;
 			return *this;
 		}
 
+		Ref(const Ref<T, true>& x) : pobj(nullptr)
+		{
+			CopyRef(const_cast<Ref<T, true>&>(x));
+		}
 		template <class T2, bool isVirtual>
-		Ref(Ref<T2, isVirtual> x)
+		Ref(Ref<T2, isVirtual> x) : pobj(nullptr)
 		{
 			static_assert(std::is_base_of<T, T2>::value, "T2 should be subclass of T.");
-			delete pobj;
-			pobj = nullptr;
-			okey = x.GetObjectId();
+			CopyRef(x);
 		}
 
 
-		explicit Ref(ObjectKey key)
+		explicit Ref(ObjectKey key) : pobj(nullptr), okey(key), cls(nullptr)
 		{
 			static_assert(std::is_base_of<DObject, T>::value, "T should be subclass of DObject.");
-			pobj = nullptr;
-			okey = key;
 		}
 
 		~Ref()
 		{
-			delete pobj;
+			Release();
 		}
 	};
 
 
-	extern ObjectKey AllocObjectId(uint32_t cls_id, uint32_t size);
+	/*
+	Hints for allocating shared objects.
+	ReadOnly objects should be fully initialized before any other thread reads
+	them, and should never be written after that. Their blocks are cached on
+	every node with no directory state and no renew traffic, so a later write
+	is not seen by the nodes that have already cached the block. For the
+	same reason, a node takes the ReadOnly keys in turn from its own range,
+	and the key of a deleted ReadOnly object is allocated again only after
+	the node has used all the others (see DSM_READONLY_NODE_SHIFT).
+	WriteInvalidate objects are kept coherent by invalidation: a write makes
+	the other caches drop their copies instead of sending them the new value.
+	Use it for data that is written often and seldom read by other nodes.
+	*/
+	enum AllocHint
+	{
+		ReadWrite,
+		ReadOnly,
+		WriteInvalidate,
+	};
+
+	extern ObjectKey AllocObjectId(uint32_t cls_id, uint32_t size, AllocHint hint = ReadWrite);
+	//Delete an object from the backend
 	extern void DeleteObject(ObjectKey key);
+
+	//the number of words of an array of "size" elements (see DogeePackedArray.h)
+	template<typename T> struct ArrayLayout
+	{
+		static uint32_t words(uint32_t size)
+		{
+			return size*DSMInterface<T>::dsm_size_of;
+		}
+	};
+
 	template<typename T>
-	inline  Array<T>  NewArray(uint32_t size)
+	inline  Array<T>  NewArray(uint32_t size, AllocHint hint = ReadWrite)
 	{
-		return Array<T>(AllocObjectId(1, size*DSMInterface<T>::dsm_size_of));
+		return Array<T>(AllocObjectId(1, ArrayLayout<T>::words(size), hint));
 	}
 	template<typename T>
 	inline  void DelArray(Array<T> arr)
 	{
 		ObjectKey key = arr->GetObjectId();
 		DeleteObject(key);
-		DogeeEnv::backend->del(key);
 	}
 
 	template<typename T>
@@ -646,7 +1010,6 @@ namespace Dogee
 	{
 		obj->Destroy();
 		DeleteObject(obj->GetObjectId());
-		DogeeEnv::backend->del(obj->GetObjectId());
 	}
 
 
@@ -658,7 +1021,7 @@ namespace Dogee
 		template<class... _Types> inline
 			ObjectKey NewObj(_Types&&... _Args)
 		{
-			ObjectKey ok = AllocObjectId(AutoRegisterObject<T>::id, T::_LAST_ * 2);
+			ObjectKey ok = AllocObjectId(AutoRegisterObject<T>::id, T::_LAST_);
 			//SetClassId(ok, T::CLASS_ID);
 			T ret(ok, std::forward<_Types>(_Args)...);
 			return (ok);
@@ -695,18 +1058,30 @@ namespace Dogee
 	template <class T> struct AutoRegisterObject
 	{
 		static int id;
-		static DObject* createInstance(ObjectKey key)
+		static DObject* createInstance(ObjectKey key, void* mem)
 		{
 			static_assert(!std::is_abstract<T>::value, "No need to register abstract class.");
 			static_assert(std::is_base_of<DObject, T>::value, "T should be subclass of DObject.");
-			return (DObject*) (new T(key));
+			return mem ? (DObject*)(new (mem)T(key)) : (DObject*)(new T(key));
+		}
+		static void destroyInstance(DObject* obj, bool on_heap)
+		{
+			if (on_heap)
+				delete (T*)obj;
+			else
+				((T*)obj)->~T();
+		}
+		static VirtualClassInfo info()
+		{
+			VirtualClassInfo ret = { createInstance, destroyInstance, sizeof(T) };
+			return ret;
 		}
 	public:
 
 		static int Init()
 		{
 			int mid=ClassIdInc();
-			RegisterClass(mid, createInstance);
+			RegisterClass(mid, info());
 			return mid;
 		}
 
@@ -714,7 +1089,7 @@ namespace Dogee
 		{
 			static_assert(!std::is_abstract<T>::value, "No need to register abstract class.");
 			static_assert(std::is_base_of<DObject, T>::value, "T should be subclass of DObject.");
-			RegisterClass(id, createInstance);
+			RegisterClass(id, info());
 		}
 	};
 
@@ -730,4 +1105,7 @@ namespace Dogee
 	}
 	template <class T> int AutoRegisterObject<T>::id = AutoRegisterObject<T>::Init();
 }
+#include "DogeeArrayView.h"
+#include "DogeeLocalSpan.h"
+#include "DogeePackedArray.h"
 #endif
\ No newline at end of file
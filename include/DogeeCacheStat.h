@@ -0,0 +1,105 @@
+#ifndef __DOGEE_CACHE_STAT_H_
+#define __DOGEE_CACHE_STAT_H_
+
+#include "Dogee.h"
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+
+//the number of shards of the counters. Threads are spread over the shards
+#define CACHE_STAT_SHARDS 16
+//the max number of objects tracked by a shard for the hotspot report
+#define CACHE_STAT_MAX_OBJECTS 1024
+
+namespace Dogee
+{
+	enum CacheStatCounter
+	{
+		StatReads,
+		StatReadHits,
+		StatWrites,
+		StatWriteHits,
+		//blocks fetched by the prefetcher and by batched range misses
+		StatPrefetches,
+		StatBatchFetches,
+		StatEvictions,
+		StatWritebacks,
+		StatRenewsSent,
+		StatRenewsReceived,
+		StatInvalidationsSent,
+		StatInvalidationsReceived,
+		//the blocks this node has moved to another home
+		StatMigrations,
+		//the words sent by the releases in the multiple-writer mode
+		StatDiffWords,
+		StatCounterCount,
+	};
+
+	extern THREAD_LOCAL int cache_stat_shard;
+
+	/*
+	The statistics of a DSMCache. The counters are always on. Each thread
+	adds to the shard it is given on its first count, so the counters are
+	seldom shared by two cores. Misses are also counted by object in the
+	shards, for the hotspot report. The counters are summed up on reading.
+	*/
+	class CacheStat
+	{
+	private:
+		/*
+		A shard is followed by a cache line of padding, so two shards never
+		share a line. alignas is not used, as the caches holding the stats
+		are made by new, which does not keep over-alignment in C++11
+		*/
+		struct Shard
+		{
+			std::atomic<uint64_t> counters[StatCounterCount];
+			std::mutex hot_lock;
+			std::unordered_map<ObjectKey, uint64_t> hot;
+			char padding[64];
+		};
+		Shard shards[CACHE_STAT_SHARDS];
+
+		std::thread dumper;
+		std::mutex dump_lock;
+		std::condition_variable dump_cv;
+		bool dump_stop;
+
+		static int NewShard();
+		Shard& MyShard()
+		{
+			if (cache_stat_shard < 0)
+				cache_stat_shard = NewShard();
+			return shards[cache_stat_shard];
+		}
+	public:
+		CacheStat();
+		~CacheStat();
+
+		void Inc(CacheStatCounter c, uint64_t n = 1)
+		{
+			MyShard().counters[c].fetch_add(n, std::memory_order_relaxed);
+		}
+		//count a miss (or a backend access) of an object
+		void Miss(ObjectKey okey);
+
+		uint64_t Get(CacheStatCounter c);
+		static const char* Name(CacheStatCounter c);
+		//get the "n" objects with the most misses, the most missed first
+		void GetHotObjects(std::vector<std::pair<ObjectKey, uint64_t>>& out, size_t n);
+		void Reset();
+
+		//print the counters and the hotspots
+		void Dump(FILE* f = stdout);
+		//Dump() every "seconds" seconds in a background thread, until StopDump()
+		void StartDump(int seconds);
+		void StopDump();
+	};
+}
+
+#endif
@@ -32,6 +32,8 @@ namespace Dogee
 	extern void SendClosureToThreadPool(int nodeid, uint32_t param, uint32_t event, int id, char* obj, size_t sz);
 	extern void InitLocalThreadPool();
 	extern void DeleteLocalThreadPool();
+	//the threads of this node running the closures of the DThreadPool, nullptr if there is none
+	extern LThreadPool* GetLocalThreadPool();
 
 	class DThreadPool
 	{
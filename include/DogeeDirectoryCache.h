@@ -3,14 +3,37 @@
 #include "DogeeStorage.h"
 #include <unordered_map>
 #include <queue>
+#include <functional>
+#include <cstddef>
+#include <algorithm>
 #include "DogeeAPIWrapping.h"
 #include <thread>
 #include "DogeeSocket.h"
+#ifndef _WIN32
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #include "DogeeUtil.h"
 #include "DogeeEnv.h"
+#include "DogeeThreadPool.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #define CACHE_HELLO_MAGIC (0x2e3a4f01)
 #define CACHE_MAX_CHUNK 4096
+//the max number of blocks fetched by one batch of misses
+#define CACHE_BATCH_BLOCKS 64
+//the number of entries of the per-thread L0 cache, should be a power of 2
+#define CACHE_L0_SIZE 16
+//the max number of messages of a peer a server thread handles before serving other peers
+#define CACHE_SERVER_BATCH 16
+//the max number of twinned blocks before the writes are released
+#define CACHE_MAX_TWINS (DSM_CACHE_SIZE / 4)
+//the count bits of CacheBlock::wc_pending and wc_words, the rest is the generation of the block
+#define CACHE_WC_COUNT_MASK 0xffffu
+//the max number of homes a thread remembers writing to, before it syncs with all the nodes at a release
+#define CACHE_SYNC_HOMES 16
 
 namespace Dogee
 {
@@ -20,6 +43,28 @@ namespace Dogee
 		unsigned long lru;
 		uint64_t key;
 		BD_RWLOCK lock;
+		//fetched by the prefetcher and not yet read by any thread
+		std::atomic<bool> prefetched;
+		//the copy is stale and should be fetched again before it is read
+		std::atomic<bool> invalid;
+		//the updates received since the last local access (CoherenceAdaptive)
+		std::atomic<int> unread_renews;
+		//changed whenever the block is swapped out, dropped or invalidated
+		std::atomic<uint32_t> version;
+		/*
+		The low bits of wc_pending[i] count the write-combining buffers
+		holding word i, and wc_words is the sum. The high bits of both are
+		the generation of the block, changed by wcreset whenever the block
+		is given back, so that a buffer flushed later does not count down
+		a reused block. A block with pending words is not swapped out, and
+		they are kept when the block is fetched again or renewed
+		*/
+		std::atomic<uint32_t> wc_pending[DSM_CACHE_BLOCK_SIZE];
+		std::atomic<uint32_t> wc_words;
+		//the block is pinned (see DSMCache::Pin) and is not swapped out
+		std::atomic<bool> pinned;
+		//the block has a twin (multiple-writer mode) and is not swapped out
+		std::atomic<bool> twinned;
 	};
 #pragma pack(push)
 #pragma pack(4)
@@ -36,11 +81,94 @@ namespace Dogee
 
 		void doget(LongKey k, std::function<void(CacheBlock*)> func);
 
+		/*
+		The per-thread L0 cache of the blocks read lately. l0get reads a block
+		without any lock if it is found with an unchanged version. l0put
+		records a block and the version read while its lock was held.
+		*/
+		uint32_t instance_id;
+		static uint32_t NewInstanceId();
+		bool l0get(uint64_t k, std::function<void(CacheBlock*)>& func);
+		void l0put(uint64_t k, CacheBlock* blk, uint32_t version);
+
+		/*
+		The per-thread write-combining buffer (DogeeEnv::CacheConfig::
+		write_combining). A write hit is added to the buffer if it follows
+		the buffered words in the same block, and the buffer is sent to
+		the home as one write when the next write does not, when it
+		reaches the end of the block, and on Fence(). wccombine writes the
+		local copy as well, and should be called with the lock of the
+		block held.
+		*/
+		void wccombine(uint64_t addr, uint32_t* v, uint32_t len, CacheBlock* blk);
+		void wcflush();
+		//start a new generation of the pending counts. The block's write lock should be held
+		void wcreset(CacheBlock* blk);
+
+		/*
+		The twins of the multiple-writer mode (DogeeEnv::CacheConfig::
+		multiple_writers). The first write hit to a block saves a twin, a
+		copy of the block before the write, and the writes only change
+		the local copy. mwflush compares the twinned blocks with their
+		twins and sends the changed words to the homes. The updates from
+		the other nodes are copied to the twin as well (renewblock), so
+		that they are not sent back. mwwrite should be called with the
+		lock of the block held. The lock of a block is taken before twin_lock.
+		*/
+		struct Twin
+		{
+			CacheBlock* blk;
+			uint32_t data[DSM_CACHE_BLOCK_SIZE];
+		};
+		std::unordered_map<uint64_t, Twin> twins;
+		std::mutex twin_lock;
+		std::atomic<int> twin_count;
+		//held through a whole mwflush, including its Sync
+		std::mutex mw_flush_lock;
+		void mwwrite(uint64_t addr, uint32_t* v, uint32_t len, CacheBlock* blk);
+		void mwflush();
+		/*
+		write the words already sent to the home to a cached block. The
+		words still in the write-combining buffers are kept, as they reach
+		the home later. If remote, the words come from another node, and
+		the words this node changed since the twin was made are kept as
+		well. The block's lock should be held
+		*/
+		void renewblock(CacheBlock* blk, uint32_t offset, uint32_t* v, uint32_t len, bool remote);
+		//forget the twin of a block that is given back. The block's lock should be held
+		void twindrop(CacheBlock* blk);
+
 		//get data within a cache block
 		void getblockdata(LongKey k, uint32_t len,uint32_t* buf);
 
 		SoStatus doput(LongKey k, uint32_t* v, uint32_t len);
 
+		//fill a new block on a read miss
+		SoStatus fetchblock(uint64_t k, CacheBlock* blk);
+
+		//write to a read-only object, bypassing the protocal
+		SoStatus putreadonly(LongKey k, uint32_t* v, uint32_t len);
+
+		//the accesses of the threads in a DsmStreamingScope, which allocate no block
+		void streamget(uint64_t k, std::function<void(CacheBlock*)>& func);
+		SoStatus streamput(uint64_t k, uint32_t len, uint32_t* v);
+
+		//give back a new block whose miss failed. The block's lock should be held
+		void dropblock(uint64_t k, CacheBlock* blk);
+
+		//fetch an invalidated block again, in place
+		void refetch(uint64_t k, CacheBlock* blk);
+
+		/*
+		Fetch the uncached blocks of [k, k+len) (at most CACHE_BATCH_BLOCKS
+		blocks) in one batch. If wdata is not NULL, the blocks fully covered
+		by the range are written with wdata instead, and written[j] tells
+		whether the j-th block of the range is done
+		*/
+		void batchmiss(uint64_t k, uint32_t len, uint32_t* wdata, bool* written);
+		SoStatus getrange(uint64_t k, uint32_t len, uint32_t* v);
+		SoStatus putrange(uint64_t k, uint32_t len, uint32_t* v, bool* written);
+
 		//put data within a cache block
 		SoStatus putblockdata(LongKey k, uint32_t len, uint32_t* buf);
 
@@ -61,6 +189,10 @@ namespace Dogee
 		BD_LOCK queue_lock;
 		BD_RWLOCK hash_lock;
 
+		//the pinned block addresses and how many times each of them is pinned
+		std::unordered_map<uint64_t, int> pins;
+		std::mutex pin_lock;
+
 		std::vector<std::string> hosts;
 		std::vector<int> ports;
 		int cache_id;
@@ -68,20 +200,132 @@ namespace Dogee
 		SOCKET datalisten;
 		CacheBlock* find_block(uint64_t key);
 
+		/*
+		The stride prefetcher. Every thread watches the block addresses of its
+		read misses (and of its first reads to prefetched blocks). When two
+		consecutive ones have the same stride, the next blocks of the stream
+		are fetched by the prefetch threads.
+		*/
+		LThreadPool* prefetcher;
+		std::atomic<int> prefetch_inflight;
+		void stream_access(uint64_t k, bool prefetched_hit);
+		void prefetch(uint64_t k);
+
 		class DSMCacheProtocal;
 		DSMCacheProtocal* protocal;
 
 		class DSMCacheProtocal
 		{
 		private:
-			std::unordered_map<uint64_t, uint64_t> directory;
+			/*
+			The caches holding a copy of a block. Sharers are kept in a list,
+			so the directory is not limited in the number of nodes and
+			an update only visits the caches that actually share the block.
+			*/
+			struct DirectoryEntry
+			{
+				std::vector<int> sharers;
+
+				bool has(int id) const
+				{
+					return std::find(sharers.begin(), sharers.end(), id) != sharers.end();
+				}
+				void add(int id)
+				{
+					if (!has(id))
+						sharers.push_back(id);
+				}
+				//returns true if no sharer is left
+				bool remove(int id)
+				{
+					auto itr = std::find(sharers.begin(), sharers.end(), id);
+					if (itr != sharers.end())
+					{
+						*itr = sharers.back();
+						sharers.pop_back();
+					}
+					return sharers.empty();
+				}
+			};
+			std::unordered_map<uint64_t, DirectoryEntry> directory;
 			BD_RWLOCK dir_lock;
-			typedef std::unordered_map<uint64_t, uint64_t>::iterator dir_iterator;
+			typedef std::unordered_map<uint64_t, DirectoryEntry>::iterator dir_iterator;
+
+			/*
+			The copies of the blocks owned by this home node, used when
+			DogeeEnv::CacheConfig::home_owned_blocks is set. "dirty" has
+			a bit for each word not yet written to the backend. Blocks are
+			dropped in the order they were loaded, writing the dirty words back.
+			*/
+			struct HomeBlock
+			{
+				uint32_t data[DSM_CACHE_BLOCK_SIZE];
+				uint32_t dirty;
+			};
+			std::unordered_map<uint64_t, HomeBlock> home_blocks;
+			std::queue<uint64_t> home_order;
+			std::mutex home_lock;
+			bool home_owned;
+			//home_lock should be held
+			HomeBlock* HomeLoad(uint64_t baddr);
+			void HomeWriteback(uint64_t baddr, HomeBlock& hblk);
+			//read a block of this home, from the home copy or the backend
+			SoStatus HomeGetBlock(uint64_t baddr, uint32_t* outbuf);
+			//write to a block of this home, to the home copy or the backend
+			SoStatus HomePut(uint64_t addr, uint32_t* v, uint32_t len);
+
+			/*
+			The home of a block is (addr >> DSM_CACHE_BITS) % caches, unless
+			it has moved. When DogeeEnv::CacheConfig::migrate_writes writes
+			in a row to a block come from the same node, the home moves the
+			block (its directory entry) to that node and keeps a forwarding
+			entry in "homes". A request sent to an old home is answered with
+			MsgReplyMoved and the new home, which the sender records in its
+			own "homes" before sending the request again.
+			*/
+			std::unordered_map<uint64_t, int> homes;
+			BD_RWLOCK homes_lock;
+			//if any entry was ever added to "homes"
+			std::atomic<bool> relocated;
+			struct WriterStat
+			{
+				int writer = -1;
+				int run = 0;
+			};
+			std::unordered_map<uint64_t, WriterStat> writer_stats;
+			std::mutex writer_lock;
+			int HomeOf(uint64_t addr);
+			void SetHome(uint64_t baddr, int home);
+			//handle a MsgReplyMoved
+			void Redirect(uint64_t addr, int home);
+			//returns true if the block should move to src_id
+			bool CountWrite(uint64_t baddr, int src_id);
+			void Migrate(uint64_t baddr, int to);
+			void ServerMigrate(uint64_t baddr, uint32_t* sharers, uint32_t n);
+			void SendMoved(uint64_t addr, int src_id, int home);
 
 			SOCKET* controlsockets;
 			SOCKET* datasockets;
 			BD_LOCK*   datasocketlocks;
+#ifdef _WIN32
+			//one server thread per peer, blocked on the control socket of the peer
 			std::thread* threads;
+#else
+			/*
+			The control sockets of the peers are in an epoll set, waited on by
+			DogeeEnv::CacheConfig::protocal_threads server threads. Each socket
+			is registered with EPOLLONESHOT and re-armed after a thread handled
+			its messages, so the messages of a peer are handled one at a time,
+			in order, while a slow backend call only holds up its own peer.
+			*/
+			int epoll_fd;
+			//an eventfd made readable to stop all the server threads
+			int stop_fd;
+			std::vector<std::thread> server_threads;
+			void StartServer();
+			void StopServer();
+			static void ServerProc(DSMCacheProtocal* ths);
+#endif
 			DSMDirectoryCache* ths;
 			int caches;
 			enum CacheMessageKind
@@ -96,6 +340,14 @@ namespace Dogee
 				MsgWriteback,
 				MsgWriteChunk,
 				MsgRenewChunk,
+				MsgReadMissBatch,
+				MsgInvalidate,
+				MsgReadUncached,
+				MsgMigrate,
+				MsgReplyMoved,
+				MsgSync,
+				MsgSyncMark,
+				MsgSyncMarkAck,
 			};
 
 			struct Params
@@ -144,12 +396,12 @@ namespace Dogee
 						else
 							ths->datasockets[pack.cacheid] = sock;
 
+#ifdef _WIN32
 						if (j % 2 == 0)
 						{
-							std::thread th(CacheProtocalProc, ths, pack.cacheid);
-							th.detach();
-							ths->threads[pack.cacheid] = std::move(th);
+							ths->threads[pack.cacheid] = std::thread(CacheProtocalProc, ths, pack.cacheid);
 						}
+#endif
 						CacheHelloPackage pack2 = { CACHE_HELLO_MAGIC, ths->ths->cache_id };
 						Socket::RcSend(sock, &pack2, sizeof(pack2));
 
@@ -159,6 +411,10 @@ namespace Dogee
 			}
 #pragma pack(push)
 #pragma pack(4)
+			/*
+			Only the header and the first "len" words of buf go on the wire.
+			Use SendPack/RecvPack instead of sending the whole struct.
+			*/
 			struct DataPack
 			{
 				uint64_t addr;
@@ -169,58 +425,169 @@ namespace Dogee
 			struct ServerWriteReply
 			{
 				uint64_t addr;
+				//-1, or the node to send the write to if the home of the block has moved
+				int32_t home;
 			};
 #pragma pack(pop)
 
+			static int SendPack(SOCKET s, DataPack& pack)
+			{
+				//header and payload in one send, so that concurrent senders on a socket never interleave
+				return Socket::RcSend(s, &pack, offsetof(DataPack, buf) + sizeof(pack.buf[0]) * pack.len);
+			}
+
+			static bool RecvPack(SOCKET s, DataPack& pack)
+			{
+				const int header = offsetof(DataPack, buf);
+				if (Socket::RcRecvAll(s, &pack, header) != header)
+					return false;
+				if (pack.len > DSM_CACHE_BLOCK_SIZE)
+				{
+					printf("Bad cache pack length %u\n", pack.len);
+					return false;
+				}
+				int payload = sizeof(pack.buf[0]) * pack.len;
+				return Socket::RcRecvAll(s, pack.buf, payload) == payload;
+			}
+
+			/*
+			The renews and invalidations are sent without waiting for the
+			sharers, so the release of a writer could reach another node
+			before them. At a release, a thread sends MsgSync to each home
+			it has written to since its last release (see Sync). The home
+			then sends a MsgSyncMark to each peer it has sent coherence
+			messages to since its last mark. A peer handles the messages of
+			a node in order, so its MsgSyncMarkAck means that all of them
+			are applied, and the MsgSync is answered once the marks it waits
+			for are acknowledged. No server thread waits in the meantime.
+			*/
+			//the renews and invalidations sent to each peer, counted after they are sent
+			std::atomic<uint64_t>* coh_sent;
+			//the counts each peer has been sent a mark for, and has acknowledged
+			std::vector<uint64_t> mark_sent;
+			std::vector<uint64_t> mark_acked;
+			struct PendingSync
+			{
+				int src;
+				std::vector<uint64_t> targets;
+			};
+			std::vector<PendingSync> pending_syncs;
+			std::mutex sync_lock;
+			std::condition_variable sync_cv;
+			//send the marks needed by a sync from src_id, and return the counts to wait for. sync_lock should be held
+			std::vector<uint64_t> SyncTargets(int src_id);
+			bool SyncDone(const std::vector<uint64_t>& targets);
+			void ServerSync(int src_id);
+			void ServerSyncMark(uint64_t count, int src_id);
+			void ServerSyncAck(uint64_t count, int src_id);
+			//record that the current thread has written to a block of "home"
+			void AddSyncHome(int home);
+
+			//send the new value to every sharer of the block except src_id. dir_lock should be held
+			void RenewSharers(const DirectoryEntry& entry, uint64_t addr, int src_id, uint32_t* v, uint32_t len);
+			/*
+			make every sharer of the block except src_id drop its copy. dir_lock
+			should be held for writing. Returns true if no sharer is left
+			*/
+			bool InvalidateSharers(DirectoryEntry& entry, uint64_t baddr, int src_id);
+			//if writes to the address should invalidate the other copies
+			static bool Invalidates(uint64_t addr)
+			{
+				return DogeeEnv::CacheConfig::coherence == DogeeEnv::CacheConfig::CoherenceInvalidate
+					|| DSM_IS_INVALIDATE_KEY(addr >> 32);
+			}
+			void ServerInvalidate(uint64_t baddr, int src_id);
+			//CoherenceAdaptive: leave the sharers of a block that keeps being updated but not accessed
+			void CountRenew(CacheBlock* blk, uint64_t baddr, int src_id);
 			void ServerRenewChunk(uint64_t addr, int src_id, uint32_t* v);
 			void ServerRenew(uint64_t addr, int src_id, uint32_t* v, uint32_t len);
-			void ServerWrite(uint64_t addr, int src_id, uint32_t* v, uint32_t len);
+			//returns -1, or the node to write to if this node is not the home of the block
+			int ServerWrite(uint64_t addr, int src_id, uint32_t* v, uint32_t len);
 			void ServerWriteback(uint64_t addr, int src_id);
 			CacheMessageKind ServerWriteMiss(uint64_t addr, int src_id, uint32_t* v,uint32_t in_len, uint32_t* outbuf);
-			CacheMessageKind ServerReadMiss(uint64_t addr, int src_id, uint32_t* outbuf);
+			//if share is false, the block is read without making src_id a sharer
+			CacheMessageKind ServerReadMiss(uint64_t addr, int src_id, uint32_t* outbuf, bool share = true);
+			SoStatus ReadBlock(uint64_t addr, uint32_t* buf, bool share);
 
+			//handle a message received from the control socket of a peer
+			void HandlePack(int target_id, DataPack& pack)
+			{
+				switch (pack.kind)
+				{
+				case MsgReadMiss:
+					ServerReadMiss(pack.addr, target_id, NULL);
+					break;
+				case MsgWriteMiss:
+					ServerWriteMiss(pack.addr, target_id, pack.buf,pack.len, NULL);
+					break;
+				case MsgWriteChunkMiss:
+					ServerWriteMiss(pack.addr, target_id, pack.buf, pack.len, NULL);
+					break;
+				case MsgWrite:
+					ServerWrite(pack.addr, target_id, pack.buf,pack.len);
+					break;
+				case MsgRenew:
+					ServerRenew(pack.addr, target_id, pack.buf, pack.len);
+					break;
+				case MsgWriteback:
+					ServerWriteback(pack.addr, target_id);
+					break;
+				case MsgRenewChunk:
+					ServerRenewChunk(pack.addr, target_id, pack.buf);
+					break;
+				case MsgReadUncached:
+					ServerReadMiss(pack.addr, target_id, NULL, false);
+					break;
+				case MsgInvalidate:
+					ServerInvalidate(pack.addr, target_id);
+					break;
+				case MsgMigrate:
+					ServerMigrate(pack.addr, pack.buf, pack.len);
+					break;
+				case MsgSync:
+					ServerSync(target_id);
+					break;
+				case MsgSyncMark:
+					ServerSyncMark(pack.addr, target_id);
+					break;
+				case MsgSyncMarkAck:
+					ServerSyncAck(pack.addr, target_id);
+					break;
+				case MsgReadMissBatch:
+					//the payload is a list of block addresses. Each of them gets its own reply
+					for (uint32_t i = 0; i + 1 < pack.len; i += 2)
+					{
+						uint64_t addr;
+						memcpy(&addr, pack.buf + i, sizeof(addr));
+						ServerReadMiss(addr, target_id, NULL);
+					}
+					break;
+				default:
+					printf("Bad cache server message %d\n", pack.kind);
+				}
+			}
+
+#ifdef _WIN32
 			static void CacheProtocalProc(DSMCacheProtocal* ths, int target_id)
 			{
 				DogeeEnv::InitCurrentThread();
 				DataPack pack;
 				for (;;)
 				{
-					if (Socket::RcRecv(ths->controlsockets[target_id], &pack, sizeof(pack)) != sizeof(pack))
+					if (!RecvPack(ths->controlsockets[target_id], pack))
 					{
 						printf("Cache server socket error %d\n", RcSocketLastError());
 						//_BreakPoint;
 						break;
 					}
-					switch (pack.kind)
-					{
-					case MsgReadMiss:
-						ths->ServerReadMiss(pack.addr, target_id, NULL);
-						break;
-					case MsgWriteMiss:
-						ths->ServerWriteMiss(pack.addr, target_id, pack.buf,pack.len, NULL);
-						break;
-					case MsgWriteChunkMiss:
-						ths->ServerWriteMiss(pack.addr, target_id, pack.buf, sizeof(pack.buf), NULL);
-						break;
-					case MsgWrite:
-						ths->ServerWrite(pack.addr, target_id, pack.buf,pack.len);
-						break;
-					case MsgRenew:
-						ths->ServerRenew(pack.addr, target_id, pack.buf, pack.len);
-						break;
-					case MsgWriteback:
-						ths->ServerWriteback(pack.addr, target_id);
-						break;
-					case MsgRenewChunk:
-						ths->ServerRenewChunk(pack.addr, target_id, pack.buf);
-						break;
-					default:
-						printf("Bad cache server message %d\n", pack.kind);
-					}
+					ths->HandlePack(target_id, pack);
 				}
 				return ;
 			}
+#endif
 		public:
+			//write all dirty home blocks to the backend
+			void FlushHomeBlocks();
 			void Writeback(uint64_t addr);
 			void Write(uint64_t addr, uint32_t* v,uint32_t len);
 
@@ -233,20 +600,53 @@ namespace Dogee
 			*/
 			SoStatus WriteMiss(uint64_t addr, uint32_t * v, uint32_t len, CacheBlock* blk);
 			SoStatus ReadMiss(uint64_t addr, CacheBlock* blk);
+			//read a block without caching it (see DsmStreamingScope)
+			SoStatus ReadUncached(uint64_t addr, uint32_t* buf);
+			//write to a number of uncached blocks with pipelined requests
+			void MultiWrite(int n, uint64_t* addrs, uint32_t** data, uint32_t* lens);
+			/*
+			Wait until the renews and invalidations caused by the writes the
+			current thread has sent since its last Sync are applied by the
+			sharers. Called on releases, after the writes are flushed
+			*/
+			void Sync();
+			bool IsHomeOwned()
+			{
+				return home_owned;
+			}
+
+			/*
+			Fetch a number of missing blocks with pipelined requests. The read
+			misses of each home are batched in MsgReadMissBatch messages. If
+			wdata[i] is not NULL, a write miss of the whole block is sent instead.
+			The blocks should be locked by the caller. status[i] is the result of
+			each block
+			*/
+			void MultiMiss(int n, uint64_t* addrs, uint32_t** wdata, CacheBlock** blks, SoStatus* status);
 
 
 			DSMCacheProtocal(DSMDirectoryCache* t) : ths(t)
 			{
+				home_owned = DogeeEnv::CacheConfig::home_owned_blocks;
 				caches = ths->hosts.size();
 				controlsockets = new SOCKET[caches];
 				datasockets = new SOCKET[caches];
+#ifdef _WIN32
 				threads = new std::thread[caches];
+#endif
 				datasocketlocks = new BD_LOCK[caches];
 				for (int i = 0; i < caches; i++)
 				{
 					UaInitLock(&datasocketlocks[i]);
 				}
 				UaInitRWLock(&dir_lock);
+				UaInitRWLock(&homes_lock);
+				relocated = false;
+				coh_sent = new std::atomic<uint64_t>[caches];
+				for (int i = 0; i < caches; i++)
+					coh_sent[i] = 0;
+				mark_sent.assign(caches, 0);
+				mark_acked.assign(caches, 0);
 				std::thread th(ListenSocketProc, this);
 				for (int i = ths->cache_id + 1; i < caches; i++)
 				{
@@ -296,19 +696,45 @@ namespace Dogee
 					datasockets[i] = sock;
 				}
 				th.join();
-				for (int i = 0; i < caches; i++)
+#ifdef _WIN32
+				//ListenSocketProc has started the threads of the caches with smaller ids
+				for (int i = ths->cache_id + 1; i < caches; i++)
 				{
-					if (i == ths->cache_id)
-						continue;
-					std::thread th(CacheProtocalProc, this, i);
-					th.detach();
-					threads[i] = std::move(th);
+					threads[i] = std::thread(CacheProtocalProc, this, i);
 				}
+#else
+				StartServer();
+#endif
 				printf("LISTEN OK\n");
 			}
 
 			~DSMCacheProtocal()
 			{
+#ifndef _WIN32
+				StopServer();
+#endif
+				//wake up the protocal threads blocked on the sockets and wait for them to exit
+				for (int i = 0; i < caches; i++)
+				{
+					if (i == ths->cache_id)
+						continue;
+#ifdef _WIN32
+					shutdown((SOCKET)controlsockets[i], SD_BOTH);
+					shutdown((SOCKET)datasockets[i], SD_BOTH);
+#else
+					shutdown((SOCKET)controlsockets[i], SHUT_RDWR);
+					shutdown((SOCKET)datasockets[i], SHUT_RDWR);
+#endif
+				}
+#ifdef _WIN32
+				for (int i = 0; i < caches; i++)
+				{
+					if (threads[i].joinable())
+						threads[i].join();
+				}
+#endif
+				//no server thread writes to the home blocks any more
+				FlushHomeBlocks();
 				for (int i = 0; i < caches; i++)
 				{
 					if (i == ths->cache_id)
@@ -316,14 +742,16 @@ namespace Dogee
 					closesocket((SOCKET)controlsockets[i]);
 					closesocket((SOCKET)datasockets[i]);
 					UaKillLock(&datasocketlocks[i]);
-					//fix-me : kill the thread
-					//UaStopThread(threads[i]);
 				}
 				delete[]controlsockets;
 				delete[]datasockets;
 				delete[]datasocketlocks;
+				delete[]coh_sent;
+#ifdef _WIN32
 				delete[]threads;
+#endif
 				UaKillRWLock(&dir_lock);
+				UaKillRWLock(&homes_lock);
 			}
 		};
 		//end of class DSMCacheProtocal
@@ -355,7 +783,13 @@ namespace Dogee
 		inline void freeblock(CacheBlock* blk)
 		{
 			UaEnterWriteRWLock(&blk->lock);
+			twindrop(blk);
+			wcreset(blk);
 			blk->key = DSM_CACHE_BAD_KEY;
+			blk->version++;
+			blk->prefetched = false;
+			blk->invalid = false;
+			blk->pinned = false;
 			UaLeaveWriteRWLock(&blk->lock);
 
 			UaEnterLock(&queue_lock);
@@ -369,25 +803,38 @@ namespace Dogee
 			SOCKET mcontrollisten, SOCKET mdatalisten)
 			: backend(back), hosts(mhosts), ports(mports), cache_id(mcache_id), controllisten(mcontrollisten), datalisten(mdatalisten)
 		{
-#ifdef BD_DSM_STAT
-			writes = 0;
-			whit = 0;
-			reads = 0;
-			rhit = 0;
-#endif
 			for (int i = 0; i < DSM_CACHE_SIZE; i++)
 			{
 				block_cache[i].key = DSM_CACHE_BAD_KEY;
+				block_cache[i].prefetched = false;
+				block_cache[i].invalid = false;
+				block_cache[i].unread_renews = 0;
+				block_cache[i].version = 0;
+				for (int j = 0; j < DSM_CACHE_BLOCK_SIZE; j++)
+					block_cache[i].wc_pending[j] = 0;
+				block_cache[i].wc_words = 0;
+				block_cache[i].pinned = false;
+				block_cache[i].twinned = false;
 				UaInitRWLock(&block_cache[i].lock);
 				block_queue.push(&block_cache[i]);
 			}
 			UaInitRWLock(&hash_lock);
 			UaInitLock(&queue_lock);
+			instance_id = NewInstanceId();
 			protocal = new DSMCacheProtocal(this);
+			prefetch_inflight = 0;
+			twin_count = 0;
+			prefetcher = nullptr;
+			if (DogeeEnv::CacheConfig::prefetch_max_depth > 0 && DogeeEnv::CacheConfig::prefetch_threads > 0)
+				prefetcher = new LThreadPool(DogeeEnv::CacheConfig::prefetch_threads);
 		}
 
 		~DSMDirectoryCache()
 		{
+			wcflush();
+			mwflush();
+			//stop the prefetch threads before the protocal they use
+			delete prefetcher;
 			delete protocal;
 			for (int i = 0; i < DSM_CACHE_SIZE; i++)
 			{
@@ -406,6 +853,21 @@ namespace Dogee
 		SoStatus put(ObjectKey key, FieldKey fldid, uint32_t v);
 		SoStatus put(ObjectKey key, FieldKey fldid, uint64_t v);
 		uint32_t get(ObjectKey key, FieldKey fldid);
+
+		void FlushToBackend()
+		{
+			wcflush();
+			mwflush();
+			protocal->FlushHomeBlocks();
+		}
+		void Fence()
+		{
+			wcflush();
+			mwflush();
+			protocal->Sync();
+		}
+		SoStatus Pin(ObjectKey key, FieldKey fldid, uint32_t len);
+		void Unpin(ObjectKey key, FieldKey fldid, uint32_t len);
 	};
 }
 
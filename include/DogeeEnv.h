@@ -52,6 +52,113 @@ namespace Dogee
 			static int thread_pool_max_wait;
 		};
 
+		class CacheConfig
+		{
+		public:
+			/*
+			The max number of blocks the stride prefetcher of the cache may
+			fetch ahead of a sequential or strided read stream. The actual depth
+			of each thread adapts to how many prefetched blocks are used.
+			0 by default, which disables prefetching. 8 is a good start for
+			programs that scan large arrays.
+			*/
+			static int prefetch_max_depth;
+			//the number of threads issuing prefetch requests on each node
+			static int prefetch_threads;
+			/*
+			The number of threads serving the cache protocal messages of the
+			other nodes. It does not grow with the cluster. Not used on
+			Windows, where each peer has its own thread.
+			*/
+			static int protocal_threads;
+			/*
+			If true, the home node of a block keeps the authoritative copy of
+			it and serves misses without a backend round trip. The copies are
+			written to the backend lazily, when more than home_max_blocks
+			blocks are held, at checkpoints and when the cache is closed.
+			*/
+			static bool home_owned_blocks;
+			static int home_max_blocks;
+			/*
+			If positive, a block moves its home to a node after that many
+			writes in a row from the node, so that owner-computes programs
+			write to local homes. Set to 0 to keep the homes fixed.
+			*/
+			static int migrate_writes;
+			//the max number of cache blocks pinned on each node (see DSMCache::Pin)
+			static int max_pinned_blocks;
+			/*
+			How the home node keeps the cached copies of a block coherent on
+			a write. CoherenceUpdate sends the new value to every sharer.
+			CoherenceInvalidate makes the other sharers drop the block, which
+			is fetched again on its next read. CoherenceAdaptive sends updates,
+			but a cache drops a block after coherence_drop_updates updates
+			arrive with no local access in between.
+			Objects allocated with the WriteInvalidate hint always use
+			invalidation.
+			*/
+			enum CoherenceMode
+			{
+				CoherenceUpdate,
+				CoherenceInvalidate,
+				CoherenceAdaptive,
+			};
+			static CoherenceMode coherence;
+			static int coherence_drop_updates;
+			/*
+			If true, the consecutive writes of a thread to a cached block are
+			combined and sent to the home as one write, when the thread writes
+			elsewhere, fills the block or reaches a release point (see
+			multiple_writers). Until then the other nodes do not see them.
+			Not used with multiple_writers.
+			*/
+			static bool write_combining;
+			/*
+			If true, the writes to cached blocks stay local until the thread
+			reaches a release point (a thread creation, barrier, event or
+			semaphore operation, a DThreadPool submit, or an accumulator,
+			map or reduce operation). Then only the words changed since the
+			first write are sent, and the homes merge them. Different nodes
+			writing disjoint words of a block no longer send updates to each
+			other on every write. A release returns after the changed words
+			of every thread of the node are merged by the homes and the other
+			caches have applied the renews or invalidations they cause, so a
+			node sees them after an acquire that follows the release.
+			*/
+			static bool multiple_writers;
+			/*
+			If positive, the statistics of the cache (see DSMCache::GetStat)
+			are printed every stat_dump_interval seconds, with the
+			stat_hot_objects objects that miss the most.
+			*/
+			static int stat_dump_interval;
+			static int stat_hot_objects;
+			/*
+			If true, a DSMEpochCache is put in front of the cache. It caches
+			the reads until the thread passes a barrier, with no coherence.
+			Only for programs whose shared data is never read and written by
+			different nodes between two barriers. epoch_cache_blocks is the
+			max number of blocks it holds.
+			*/
+			static bool epoch_cache;
+			static int epoch_cache_blocks;
+			/*
+			If not empty, a DSMTraceCache is put in front of the cache, and
+			each thread writes its accesses to the file
+			"<trace_path>.<node id>.<thread>.trace", to be replayed by
+			tools/CacheSim.
+			*/
+			static std::string trace_path;
+			/*
+			The number of words an ArrayView (see Array::view) reads and
+			writes at a time, and the number of threads on each node fetching
+			the next windows of the views. With 0 threads, a window is only
+			fetched when it is accessed.
+			*/
+			static int view_window;
+			static int view_prefetch_threads;
+		};
+
 		static void InitCurrentThread();
 
 		static void  DestroyCurrentThread();
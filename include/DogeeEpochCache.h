@@ -0,0 +1,94 @@
+#ifndef __DOGEE_EPOCH_CACHE_H_
+#define __DOGEE_EPOCH_CACHE_H_
+
+#include "DogeeStorage.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+//the number of independently locked parts of the epoch cache
+#define EPOCH_CACHE_STRIPES 64
+
+namespace Dogee
+{
+	/*
+	A read cache for BSP programs, put in front of any DSMCache (even
+	DSMNoCache). Blocks are read through the inner cache and kept with
+	the epoch they were read in. There is no directory and no coherence
+	message: a thread passing a barrier calls NewEpoch(), which makes
+	every block of the older epochs stale at once. Writes go through to
+	the inner cache and update the cached copies of this node.
+	So a read may see a stale value if another node writes to the block
+	since the last barrier of the reader. Only use it when the shared
+	data that is read is not written by other nodes between two barriers.
+	See DogeeEnv::CacheConfig::epoch_cache.
+	*/
+	class DSMEpochCache : public DSMCache
+	{
+	private:
+		struct EpochBlock
+		{
+			uint32_t epoch;
+			uint32_t data[DSM_CACHE_BLOCK_SIZE];
+		};
+		struct Stripe
+		{
+			std::mutex lock;
+			std::unordered_map<uint64_t, EpochBlock> blocks;
+			//bumped by each local write, so that a miss does not cache a block older than the write
+			uint64_t writes = 0;
+		};
+		DSMCache* inner;
+		std::atomic<uint32_t> epoch;
+		size_t max_blocks;
+		Stripe stripes[EPOCH_CACHE_STRIPES];
+
+		Stripe& stripe_of(uint64_t baddr)
+		{
+			return stripes[(baddr >> DSM_CACHE_BITS) % EPOCH_CACHE_STRIPES];
+		}
+		//make room in a full stripe. The caller holds the lock of the stripe
+		void shrink(Stripe& s, uint32_t cur);
+		SoStatus read(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf);
+		//copy the written data to the blocks of the current epoch
+		void update(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf);
+	public:
+		//the epoch cache owns "inner" and deletes it on destruction
+		DSMEpochCache(DSMCache* inner);
+		~DSMEpochCache();
+
+		SoStatus put(ObjectKey key, FieldKey fldid, uint64_t v);
+		SoStatus put(ObjectKey key, FieldKey fldid, uint32_t v);
+		uint32_t get(ObjectKey key, FieldKey fldid);
+		SoStatus getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf);
+		SoStatus getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf);
+		SoStatus putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf);
+		SoStatus putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf);
+		void FlushToBackend()
+		{
+			inner->FlushToBackend();
+		}
+		void Fence()
+		{
+			inner->Fence();
+		}
+		SoStatus Pin(ObjectKey key, FieldKey fldid, uint32_t len)
+		{
+			return inner->Pin(key, fldid, len);
+		}
+		void Unpin(ObjectKey key, FieldKey fldid, uint32_t len)
+		{
+			inner->Unpin(key, fldid, len);
+		}
+		void NewEpoch()
+		{
+			epoch++;
+		}
+		DSMCache* GetInner()
+		{
+			return inner;
+		}
+	};
+}
+
+#endif
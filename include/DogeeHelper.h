@@ -7,6 +7,8 @@
 #endif
 #include "DogeeEnv.h"
 #include "DogeeDirectoryCache.h"
+#include "DogeeEpochCache.h"
+#include "DogeeTraceCache.h"
 #include "DogeeSocket.h"
 #include "DogeeCheckpoint.h"
 namespace Dogee
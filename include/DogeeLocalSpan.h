@@ -0,0 +1,138 @@
+#ifndef __DOGEE_LOCAL_SPAN_H_
+#define __DOGEE_LOCAL_SPAN_H_
+
+#include "DogeeBase.h"
+
+namespace Dogee
+{
+	template<typename T> class LocalSpanMapping : public DsmLocalMapping
+	{
+	private:
+		Array<T> arr;
+		uint32_t start;
+		uint32_t len;
+		//the words of the range, and their values when last read or written back
+		std::vector<uint32_t> words;
+		std::vector<uint32_t> twin;
+	public:
+		LocalSpanMapping(Array<T> arr, uint32_t start, uint32_t len)
+			: arr(arr), start(start), len(len), words(len * DSMInterface<T>::dsm_size_of)
+		{
+			Refresh();
+			AddLocalMapping(this);
+		}
+		~LocalSpanMapping()
+		{
+			Release();
+			RemoveLocalMapping(this);
+		}
+
+		T* data()
+		{
+			return (T*)words.data();
+		}
+		uint32_t size()
+		{
+			return len;
+		}
+
+		//write the words changed since the last read or write back, one chunk access for each run of them
+		void Release()
+		{
+			const uint32_t base = start * DSMInterface<T>::dsm_size_of;
+			uint32_t n = (uint32_t)words.size();
+			uint32_t i = 0;
+			while (i < n)
+			{
+				if (words[i] == twin[i])
+				{
+					i++;
+					continue;
+				}
+				uint32_t first = i;
+				while (i < n && words[i] != twin[i])
+				{
+					twin[i] = words[i];
+					i++;
+				}
+				DogeeEnv::cache->putchunk(arr.GetObjectId(), base + first, i - first, words.data() + first);
+			}
+		}
+
+		//write the changes back and read the range again
+		void Refresh()
+		{
+			if (!twin.empty())
+				Release();
+			if (!words.empty())
+				DogeeEnv::cache->getchunk(arr.GetObjectId(), start * DSMInterface<T>::dsm_size_of, (uint32_t)words.size(), words.data());
+			twin = words;
+		}
+	};
+
+	/*
+	A local array holding the elements [start, start+len) of a DSM array,
+	made by Array::MapLocal. The range is read with one chunk access, which
+	is served from the local cache or home copies when the node owns the
+	range (see DogeeEnv::CacheConfig::home_owned_blocks and
+	migrate_writes). The elements are then read and written as a plain
+	T*, with no DSM access. When the thread that made the span reaches a
+	release point (a thread creation, barrier, event or semaphore
+	operation, a DThreadPool submit, or an accumulator operation), the
+	words changed since the last release are written back, so the other
+	nodes see them after their next acquire. The changes are also written
+	back on Flush() and when the last copy of the span is destroyed.
+	The span does not see the writes of other nodes to the range after it
+	is made, until Refresh(). It is meant for the owner-computes ranges no
+	other node writes. A span should only be used by the thread making it.
+	*/
+	template<typename T> class LocalSpan
+	{
+	private:
+		std::shared_ptr<LocalSpanMapping<T>> m;
+	public:
+		LocalSpan(Array<T> arr, uint32_t start, uint32_t len)
+			: m(std::make_shared<LocalSpanMapping<T>>(arr, start, len))
+		{
+		}
+
+		T* data() const
+		{
+			return m->data();
+		}
+		uint32_t size() const
+		{
+			return m->size();
+		}
+		T& operator[](uint32_t k) const
+		{
+			return m->data()[k];
+		}
+		T* begin() const
+		{
+			return m->data();
+		}
+		T* end() const
+		{
+			return m->data() + m->size();
+		}
+
+		void Flush()
+		{
+			m->Release();
+		}
+		void Refresh()
+		{
+			m->Refresh();
+		}
+	};
+
+	template<typename T> LocalSpan<T> Array<T>::MapLocal(uint32_t start_index, uint32_t len) const
+	{
+		static_assert(sizeof(T) == DSMInterface<T>::dsm_size_of * sizeof(uint32_t) && std::is_trivially_copyable<T>::value,
+			"MapLocal needs an element type of whole words, with the same layout in the DSM and in the local memory");
+		return LocalSpan<T>(*this, start_index, len);
+	}
+}
+
+#endif
@@ -2,13 +2,26 @@
 #define __DOGEE_MACRO_H_ 
 
 #define self Dogee::ReferenceObject(this)
-#define DefBegin(Parent) static const int _BASE_ = __COUNTER__;static const int _PBASE_ = Parent::_LAST_;
+/*
+The fields of a class are laid out after the fields of its parent, each
+taking DSMInterface<T>::dsm_size_of words (see Dogee::FieldSlot). Every
+field declares an overload of _field_ (never defined) whose return type
+holds the end of the field, and the next field finds it by overload
+resolution. _LAST_ is the number of words of the fields of the class
+*/
+#define DefBegin(Parent) _DefBegin(Parent, __COUNTER__)
+#define _DefBegin(Parent, N) static const int _BASE_ = N;static const int _PBASE_ = Parent::_LAST_;\
+	static Dogee::FieldEnd<Parent::_LAST_> _field_(Dogee::FieldIndex<0>);
+#define _PrevFieldEnd(N) decltype(_field_(Dogee::FieldIndex<N - _BASE_ - 1>()))::end
 //#define Def(Type,Name) Dogee::Value<Type,2*(__COUNTER__- _BASE_ - 1 + _PBASE_)> Name
-#define Def(Name,...) Dogee::Value<__VA_ARGS__,2*(__COUNTER__- _BASE_ - 1 + _PBASE_)> Name
-#define DefRef(Type,isVirtual,Name) Dogee::Value<Dogee::Ref<Type,isVirtual>,2*(__COUNTER__- _BASE_ - 1 + _PBASE_)> Name
+#define Def(Name,...) _Def(Name, __COUNTER__, __VA_ARGS__)
+#define _Def(Name, N, ...) static Dogee::FieldSlot<_PrevFieldEnd(N), __VA_ARGS__> _field_(Dogee::FieldIndex<N - _BASE_>);\
+	Dogee::Value<__VA_ARGS__, Dogee::FieldSlot<_PrevFieldEnd(N), __VA_ARGS__>::offset> Name
+#define DefRef(Type,isVirtual,Name) Def(Name, Dogee::Ref<Type,isVirtual>)
 
 //DefEnd must be declared public
-#define DefEnd() static const int _LAST_ = __COUNTER__- _BASE_ - 1 + _PBASE_ ;
+#define DefEnd() _DefEnd(__COUNTER__)
+#define _DefEnd(N) static const int _LAST_ = decltype(_field_(Dogee::FieldIndex<N - _BASE_>()))::end;
 
 #define AutoRegisterObjectName(n) __REG_OBJECT__##n##__
 #define _AutoRegisterObjectName(n) AutoRegisterObjectName(n)
@@ -0,0 +1,244 @@
+#ifndef __DOGEE_PACKED_ARRAY_H_
+#define __DOGEE_PACKED_ARRAY_H_
+
+#include "DogeeBase.h"
+
+namespace Dogee
+{
+	/*
+	The element type of a packed array. Array<Packed<T, bits>> keeps each
+	element in "bits" bits (1, 2, 4, 8 or 16), 32/bits elements in a word,
+	instead of a word per element. Packed<bool> and Packed<uint8_t> take 1
+	and 8 bits. A value is stored as its lower "bits" bits, so signed types
+	narrower than T are not sign-extended.
+	Writing an element reads and writes its whole word. Threads writing
+	different elements of the same word at the same time should be
+	synchronized, or some of the writes may be lost.
+	*/
+	template<typename T, int bits = std::is_same<T, bool>::value ? 1 : sizeof(T) * 8>
+	struct Packed
+	{
+		static_assert(std::is_integral<T>::value, "the element of a packed array should be an integer or bool");
+		static_assert((bits == 1 || bits == 2 || bits == 4 || bits == 8 || bits == 16) && bits <= (int)sizeof(T) * 8,
+			"the elements of a packed array should be of 1, 2, 4, 8 or 16 bits");
+		static const uint32_t per_word = 32 / bits;
+		static const uint32_t mask = (1u << bits) - 1;
+
+		static T Extract(uint32_t word, uint32_t index)
+		{
+			return (T)((word >> (index % per_word * bits)) & mask);
+		}
+		static uint32_t Insert(uint32_t word, uint32_t index, T v)
+		{
+			uint32_t shift = index % per_word * bits;
+			return (word & ~(mask << shift)) | (((uint32_t)v & mask) << shift);
+		}
+
+		/*
+		Unpack elements [first, first+n) of the packed words to "out".
+		words[0] is the word of element "first". The whole words are
+		unpacked by a fixed-length inner loop, which the compiler
+		vectorizes (e.g. with -O3 -march=native)
+		*/
+		static void Unpack(const uint32_t* words, uint32_t first, uint32_t n, T* out)
+		{
+			uint32_t i = 0;
+			uint32_t base = first / per_word;
+			for (; i < n && (first + i) % per_word; i++)
+				out[i] = Extract(words[(first + i) / per_word - base], first + i);
+			for (; i + per_word <= n; i += per_word)
+			{
+				uint32_t w = words[(first + i) / per_word - base];
+				for (uint32_t k = 0; k < per_word; k++)
+					out[i + k] = (T)((w >> (k * bits)) & mask);
+			}
+			for (; i < n; i++)
+				out[i] = Extract(words[(first + i) / per_word - base], first + i);
+		}
+
+		//the other way of Unpack. The bits of the elements out of the range are kept
+		static void Pack(const T* in, uint32_t first, uint32_t n, uint32_t* words)
+		{
+			uint32_t i = 0;
+			uint32_t base = first / per_word;
+			for (; i < n && (first + i) % per_word; i++)
+				words[(first + i) / per_word - base] = Insert(words[(first + i) / per_word - base], first + i, in[i]);
+			for (; i + per_word <= n; i += per_word)
+			{
+				uint32_t w = 0;
+				for (uint32_t k = 0; k < per_word; k++)
+					w |= ((uint32_t)in[i + k] & mask) << (k * bits);
+				words[(first + i) / per_word - base] = w;
+			}
+			for (; i < n; i++)
+				words[(first + i) / per_word - base] = Insert(words[(first + i) / per_word - base], first + i, in[i]);
+		}
+	};
+
+	template<typename T, int bits> class PackedArrayElement
+	{
+	private:
+		typedef Packed<T, bits> P;
+		ObjectKey ok;
+		uint32_t index;
+	public:
+		PackedArrayElement(ObjectKey o_key, uint32_t idx) : ok(o_key), index(idx)
+		{
+		}
+
+		//the address of the word holding the element
+		LongKey get_address()
+		{
+			return (((LongKey)ok) << 32 | (index / P::per_word));
+		}
+
+		T get()
+		{
+			return P::Extract(DogeeEnv::cache->get(ok, index / P::per_word), index);
+		}
+
+		void set(T x)
+		{
+			FieldKey fk = index / P::per_word;
+			DogeeEnv::cache->put(ok, fk, P::Insert(DogeeEnv::cache->get(ok, fk), index, x));
+		}
+
+		//copy
+		PackedArrayElement<T, bits>& operator=(PackedArrayElement<T, bits>& x)
+		{
+			set(x.get());
+			return *this;
+		}
+
+		//read
+		operator T()
+		{
+			return get();
+		}
+
+		//write
+		T operator=(T x)
+		{
+			set(x);
+			return x;
+		}
+	};
+
+	template<typename T, int bits> struct ArrayLayout<Packed<T, bits>>
+	{
+		static uint32_t words(uint32_t size)
+		{
+			return (size + Packed<T, bits>::per_word - 1) / Packed<T, bits>::per_word;
+		}
+	};
+
+	template<typename T, int bits> struct ArrayViewTraits<Packed<T, bits>>
+	{
+		typedef T value_type;
+		static uint32_t elements(uint32_t words)
+		{
+			return words * Packed<T, bits>::per_word;
+		}
+	};
+
+	template<typename T, int bits> class Array<Packed<T, bits>>
+	{
+	private:
+		typedef Packed<T, bits> P;
+		ObjectKey object_id;
+	public:
+		ObjectKey GetObjectId() const
+		{
+			return object_id;
+		}
+		explicit Array(ObjectKey obj_id)
+		{
+			object_id = obj_id;
+		}
+		Array()
+		{
+			object_id = 0;
+		}
+		const Array<P>*const operator->() const
+		{
+			return this;
+		}
+
+		PackedArrayElement<T, bits> ArrayAccess(int k) const
+		{
+			return PackedArrayElement<T, bits>(object_id, k);
+		}
+
+		PackedArrayElement<T, bits> operator[](int k) const
+		{
+			return ArrayAccess(k);
+		}
+		operator bool() const
+		{
+			return (object_id != 0);
+		}
+
+		//Fill is a one-pass stream, so it does not allocate cache blocks (see DsmStreamingScope)
+		void Fill(std::function<T(uint32_t)> func, uint32_t start_index, uint32_t len) const
+		{
+			DsmStreamingScope scope;
+			const uint32_t bsize = DSM_CACHE_BLOCK_SIZE * 8 * P::per_word;
+			T blk[bsize];
+			for (uint32_t i = 0; i < len; i += bsize)
+			{
+				uint32_t n = len - i < bsize ? len - i : bsize;
+				for (uint32_t j = 0; j < n; j++)
+					blk[j] = func(i + j);
+				CopyFrom(blk, start_index + i, n);
+			}
+		}
+
+		//if streaming is true, the copy does not allocate cache blocks (see DsmStreamingScope)
+		void CopyTo(T* localarr, uint32_t start_index, uint32_t copy_len, bool streaming = false) const
+		{
+			DsmStreamingScope scope(streaming);
+			const uint32_t step = ARRAY_COPY_WORDS * P::per_word;
+			std::vector<uint32_t> buf(ARRAY_COPY_WORDS + 1);
+			for (uint32_t i = 0; i < copy_len; i += step)
+			{
+				uint32_t n = copy_len - i < step ? copy_len - i : step;
+				uint32_t first = start_index + i;
+				uint32_t fw = first / P::per_word;
+				uint32_t nw = (first + n - 1) / P::per_word - fw + 1;
+				DogeeEnv::cache->getchunk(object_id, fw, nw, buf.data());
+				P::Unpack(buf.data(), first, n, localarr + i);
+			}
+		}
+
+		/*
+		The words only partly covered by the range are read and written
+		back, keeping the elements out of the range
+		*/
+		void CopyFrom(T* localarr, uint32_t start_index, uint32_t copy_len, bool streaming = false) const
+		{
+			DsmStreamingScope scope(streaming);
+			const uint32_t step = ARRAY_COPY_WORDS * P::per_word;
+			std::vector<uint32_t> buf(ARRAY_COPY_WORDS + 1);
+			for (uint32_t i = 0; i < copy_len; i += step)
+			{
+				uint32_t n = copy_len - i < step ? copy_len - i : step;
+				uint32_t first = start_index + i;
+				uint32_t fw = first / P::per_word;
+				uint32_t nw = (first + n - 1) / P::per_word - fw + 1;
+				if (first % P::per_word)
+					buf[0] = DogeeEnv::cache->get(object_id, fw);
+				if ((first + n) % P::per_word && (nw > 1 || !(first % P::per_word)))
+					buf[nw - 1] = DogeeEnv::cache->get(object_id, fw + nw - 1);
+				P::Pack(localarr + i, first, n, buf.data());
+				DogeeEnv::cache->putchunk(object_id, fw, nw, buf.data());
+			}
+		}
+
+		ArrayView<P> view(uint32_t start_index, uint32_t len, bool streaming = false) const
+		{
+			return ArrayView<P>(*this, start_index, len, streaming);
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef __DOGEE_PARTITIONED_ARRAY_H_
+#define __DOGEE_PARTITIONED_ARRAY_H_
+
+#include "DogeeBase.h"
+#include "DogeeMacro.h"
+#include "DogeeDThreadPool.h"
+#include <vector>
+#include <algorithm>
+
+namespace Dogee
+{
+	enum PartitionKind
+	{
+		//each node owns one contiguous range of about the same size
+		PartitionBlock,
+		//the chunks of "chunk" elements are dealt to the nodes in turn
+		PartitionCyclic,
+		//each node owns one contiguous range, given by its first element
+		PartitionCustom,
+	};
+
+	struct PartitionRange
+	{
+		uint32_t start;
+		uint32_t len;
+	};
+
+	/*
+	A shared array divided among the slave nodes (or the only node, if
+	the cluster has one node), for owner-computes programs. The block
+	partition gives node k (1 <= k < num_nodes) the elements
+	[size*(k-1)/(num_nodes-1), size*k/(num_nodes-1)). The owner works on
+	its elements with ForEachLocal or MapLocal, and reads the boundary
+	elements of its neighbours with FetchHalo. The writes of the owner are
+	seen by the other nodes after its next release point (e.g. a barrier).
+	Create it with NewObj<DPartitionedArray<T>>(size, kind, chunk) or
+	NewObj<DPartitionedArray<T>>(size, starts) for a custom partition.
+	*/
+	template<typename T> class DPartitionedArray : public DObject
+	{
+		DefBegin(DObject);
+	public:
+		Def(arr, Array<T>);
+		Def(size, uint32_t);
+		Def(kind, int);
+		Def(chunk, uint32_t);
+		//the first element of each part of a custom partition, followed by "size"
+		Def(starts, Array<uint32_t>);
+		DefEnd();
+
+		DPartitionedArray(ObjectKey obj_id) : DObject(obj_id)
+		{
+		}
+		DPartitionedArray(ObjectKey obj_id, uint32_t size, PartitionKind kind = PartitionBlock, uint32_t chunk = 1) : DObject(obj_id)
+		{
+			assert(kind != PartitionCustom && chunk > 0);
+			self->arr = NewArray<T>(size);
+			self->size = size;
+			self->kind = kind;
+			self->chunk = chunk;
+			self->starts = Array<uint32_t>(0);
+		}
+		//"starts" holds the first element of the part of each slave node, in the order of the nodes
+		DPartitionedArray(ObjectKey obj_id, uint32_t size, const std::vector<uint32_t>& starts) : DObject(obj_id)
+		{
+			assert(starts.size() == NumParts());
+			std::vector<uint32_t> s = starts;
+			s.push_back(size);
+			Array<uint32_t> sarr = NewArray<uint32_t>((uint32_t)s.size());
+			sarr->CopyFrom(s.data(), 0, (uint32_t)s.size());
+			self->arr = NewArray<T>(size);
+			self->size = size;
+			self->kind = PartitionCustom;
+			self->chunk = 1;
+			self->starts = sarr;
+		}
+
+		void Destroy()
+		{
+			Array<T> a = self->arr;
+			DelArray(a);
+			if (self->kind == PartitionCustom)
+			{
+				Array<uint32_t> s = self->starts;
+				DelArray(s);
+			}
+		}
+
+		//the number of nodes owning elements
+		static uint32_t NumParts()
+		{
+			return DogeeEnv::num_nodes > 1 ? DogeeEnv::num_nodes - 1 : 1;
+		}
+
+		Array<T> GetArray()
+		{
+			return self->arr;
+		}
+
+		//the node owning the element "index"
+		int Owner(uint32_t index)
+		{
+			const uint32_t parts = NumParts();
+			const int first_node = DogeeEnv::num_nodes > 1 ? 1 : 0;
+			const uint32_t sz = self->size;
+			uint32_t part;
+			switch ((PartitionKind)(int)self->kind)
+			{
+			case PartitionCyclic:
+				part = index / self->chunk % parts;
+				break;
+			case PartitionCustom:
+			{
+				std::vector<uint32_t> s(parts + 1);
+				self->starts->CopyTo(s.data(), 0, parts + 1);
+				part = (uint32_t)(std::upper_bound(s.begin(), s.end() - 1, index) - s.begin()) - 1;
+				break;
+			}
+			default:
+				part = (uint32_t)((uint64_t)index * parts / sz);
+				while (part + 1 < parts && (uint64_t)sz * (part + 1) / parts <= index)
+					part++;
+				while (part > 0 && (uint64_t)sz * part / parts > index)
+					part--;
+			}
+			return first_node + (int)part;
+		}
+
+		//the ranges of elements owned by a node, in increasing order
+		std::vector<PartitionRange> Ranges(int node_id)
+		{
+			std::vector<PartitionRange> ret;
+			const uint32_t parts = NumParts();
+			const uint32_t sz = self->size;
+			int part = DogeeEnv::num_nodes > 1 ? node_id - 1 : node_id;
+			if (part < 0 || (uint32_t)part >= parts)
+				return ret;
+			switch ((PartitionKind)(int)self->kind)
+			{
+			case PartitionCyclic:
+			{
+				const uint32_t ck = self->chunk;
+				for (uint64_t c = (uint64_t)part * ck; c < sz; c += (uint64_t)parts * ck)
+				{
+					PartitionRange r = { (uint32_t)c, (uint32_t)std::min<uint64_t>(ck, sz - c) };
+					ret.push_back(r);
+				}
+				break;
+			}
+			case PartitionCustom:
+			{
+				uint32_t s[2];
+				self->starts->CopyTo(s, part, 2);
+				PartitionRange r = { s[0], s[1] - s[0] };
+				ret.push_back(r);
+				break;
+			}
+			default:
+			{
+				uint32_t s0 = (uint32_t)((uint64_t)sz * part / parts);
+				uint32_t s1 = (uint32_t)((uint64_t)sz * (part + 1) / parts);
+				PartitionRange r = { s0, s1 - s0 };
+				ret.push_back(r);
+			}
+			}
+			return ret;
+		}
+
+		std::vector<PartitionRange> LocalRanges()
+		{
+			return Ranges(DogeeEnv::self_node_id);
+		}
+
+		//the range of this node, for the block and custom partitions. Empty if the node owns nothing
+		PartitionRange LocalRange()
+		{
+			assert(self->kind != PartitionCyclic);
+			std::vector<PartitionRange> r = LocalRanges();
+			PartitionRange empty = { 0, 0 };
+			return r.empty() ? empty : r[0];
+		}
+
+		//the local elements of this node, for the block and custom partitions (see Array::MapLocal)
+		LocalSpan<T> MapLocal()
+		{
+			PartitionRange r = LocalRange();
+			return self->arr->MapLocal(r.start, r.len);
+		}
+
+		/*
+		Read the "width" elements before and after the range of this node,
+		one chunk access for each side, for the block and custom
+		partitions. Fewer elements are read at the ends of the array
+		*/
+		void FetchHalo(uint32_t width, std::vector<T>& left, std::vector<T>& right)
+		{
+			PartitionRange r = LocalRange();
+			Array<T> a = self->arr;
+			const uint32_t sz = self->size;
+			const uint32_t end = r.start + r.len;
+			left.resize(std::min(width, r.start));
+			right.resize(std::min(width, sz - end));
+			if (!left.empty())
+				a->CopyTo(left.data(), r.start - (uint32_t)left.size(), (uint32_t)left.size());
+			if (!right.empty())
+				a->CopyTo(right.data(), end, (uint32_t)right.size());
+		}
+
+		/*
+		Call func(index, element) for every element of this node, where
+		"element" is a T&. The local elements are read with one chunk access
+		for each range (see Array::MapLocal). The chunks of a cyclic
+		partition are read in batches, each covering the chunks of this node
+		in about ARRAY_COPY_WORDS words, and the words of the other nodes
+		in a batch are not written back, as they are not changed. The calls
+		are divided among the threads of the local thread pool, and the
+		changed words of a batch are written back when all its calls
+		return. Without a local thread pool, the calls are made by the
+		current thread. "func" should not access the elements of the array
+		through the DSM
+		*/
+		template<typename Func> void ForEachLocal(Func func)
+		{
+			std::vector<PartitionRange> ranges = LocalRanges();
+			if (ranges.empty())
+				return;
+			Array<T> a = self->arr;
+			//the chunks of a node are one "cycle" apart
+			const uint32_t cycle = NumParts() * self->chunk;
+			size_t batch = 1;
+			if ((PartitionKind)(int)self->kind == PartitionCyclic)
+				batch = std::max<size_t>(1, ARRAY_COPY_WORDS / DSMInterface<T>::dsm_size_of / cycle);
+			for (size_t k = 0; k < ranges.size(); k += batch)
+			{
+				size_t n = std::min(batch, ranges.size() - k);
+				uint32_t first = ranges[k].start;
+				uint32_t last = ranges[k + n - 1].start + ranges[k + n - 1].len;
+				LocalSpan<T> span = a->MapLocal(first, last - first);
+				ForEachInSpan(ranges.data() + k, n, span, first, func);
+			}
+		}
+
+	private:
+		//call func for the elements of n ranges, all within a span starting at the element "first"
+		template<typename Func> static void ForEachInSpan(const PartitionRange* ranges, size_t n, LocalSpan<T>& span, uint32_t first, Func& func)
+		{
+			uint32_t total = 0;
+			for (size_t k = 0; k < n; k++)
+				total += ranges[k].len;
+			if (total == 0)
+				return;
+			//the calls for the elements [from, to), counted over all the ranges
+			auto run = [ranges, n, &span, first, &func](uint32_t from, uint32_t to)
+			{
+				uint32_t base = 0;
+				for (size_t k = 0; k < n && from < to; k++)
+				{
+					uint32_t len = ranges[k].len;
+					for (; from < to && from < base + len; from++)
+					{
+						uint32_t idx = ranges[k].start + (from - base);
+						func(idx, span[idx - first]);
+					}
+					base += len;
+				}
+			};
+			LThreadPool* pool = GetLocalThreadPool();
+			unsigned tasks = pool ? (unsigned)pool->GetThreadCount() : 1;
+			if (tasks == 0)
+				tasks = 1;
+			const uint32_t step = (total + tasks - 1) / tasks;
+			if (tasks == 1 || step >= total)
+			{
+				run(0, total);
+				return;
+			}
+			std::vector<std::future<int>> futures;
+			for (uint32_t from = 0; from < total; from += step)
+			{
+				uint32_t to = total - from < step ? total : from + step;
+				auto task = [&run, from, to]()
+				{
+					DogeeEnv::InitCurrentThread();
+					run(from, to);
+					return 0;
+				};
+				futures.push_back(pool->submit(task));
+			}
+			for (auto& f : futures)
+				f.wait();
+		}
+	};
+}
+
+#endif
@@ -37,6 +37,23 @@ namespace Dogee
 			return recv((SOCKET)s, (char*)data, len, 0);
 		}
 
+		/*
+		Keep receiving until exactly "len" bytes arrive. Returns the number
+		of bytes received, or the failing recv's return value on error
+		*/
+		inline int RcRecvAll(SOCKET s, void* data, size_t len)
+		{
+			size_t got = 0;
+			while (got < len)
+			{
+				int r = recv((SOCKET)s, (char*)data + got, len - got, 0);
+				if (r <= 0)
+					return r;
+				got += r;
+			}
+			return (int)got;
+		}
+
 		inline int RcCloseSocket(SOCKET s)
 		{
 			return closesocket((SOCKET)s);
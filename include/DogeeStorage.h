@@ -3,6 +3,7 @@
 
 
 #include "Dogee.h"
+#include "DogeeCacheStat.h"
 
 #define DSM_CACHE_BITS 5
 #define DSM_CACHE_BLOCK_SIZE (1<<DSM_CACHE_BITS)
@@ -13,6 +14,29 @@
 #define DSM_CACHE_BAD_KEY  ((uint64_t) DSM_CACHE_LOW_MASK)
 #define DSM_CACHE_SIZE 1024
 
+/*
+Objects with this bit set in the ObjectKey are read-only once they are
+initialized (see Dogee::ReadOnly). Caches keep their blocks without any
+coherence state.
+*/
+#define DSM_READONLY_KEY_BIT 0x80000000u
+#define DSM_IS_READONLY_KEY(okey) ((((ObjectKey)(okey)) & DSM_READONLY_KEY_BIT)!=0)
+/*
+Each node allocates the read-only keys in turn from its own range,
+DSM_READONLY_KEY_BIT | node << DSM_READONLY_NODE_SHIFT | n, so a deleted
+key is allocated again only after the node has used the whole range (see
+Dogee::AllocObjectId).
+*/
+#define DSM_READONLY_NODE_SHIFT 23
+#define DSM_READONLY_SEQ_MASK ((1u << DSM_READONLY_NODE_SHIFT) - 1)
+
+/*
+Objects with this bit set are kept coherent by invalidation (see
+Dogee::WriteInvalidate), whatever the coherence mode of the caches is.
+*/
+#define DSM_INVALIDATE_KEY_BIT 0x40000000u
+#define DSM_IS_INVALIDATE_KEY(okey) ((((ObjectKey)(okey)) & DSM_INVALIDATE_KEY_BIT)!=0)
+
 
 namespace Dogee
 {
@@ -100,12 +124,57 @@ namespace Dogee
 
 
 
+	extern THREAD_LOCAL int dsm_streaming;
+
+	/*
+	While a DsmStreamingScope is alive, the accesses of the current thread
+	that miss the cache go to the home node or the backend without
+	allocating a cache block or becoming a sharer. Blocks that are already
+	cached are still used. Use it for one-pass streams (filling or dumping
+	a large array) that would otherwise evict the hot blocks of the cache.
+	*/
+	class DsmStreamingScope
+	{
+		bool enabled;
+	public:
+		DsmStreamingScope(bool enable = true) : enabled(enable)
+		{
+			if (enabled)
+				dsm_streaming++;
+		}
+		~DsmStreamingScope()
+		{
+			if (enabled)
+				dsm_streaming--;
+		}
+	};
+
+	/*
+	A local copy of a range of the DSM, whose changes are written back
+	when its thread reaches a release point (see Array::MapLocal). The
+	mappings of a thread are kept in a thread-local intrusive list, in
+	the order they are added
+	*/
+	class DsmLocalMapping
+	{
+	public:
+		//the links of the list of the thread, set by AddLocalMapping
+		DsmLocalMapping* prev = nullptr;
+		DsmLocalMapping* next = nullptr;
+		//write the changes back
+		virtual void Release() = 0;
+		virtual ~DsmLocalMapping(){}
+	};
+	extern void AddLocalMapping(DsmLocalMapping* m);
+	//should be called by the thread adding the mapping
+	extern void RemoveLocalMapping(DsmLocalMapping* m);
+	//called by the synchronization functions before DSMCache::Fence
+	extern void ReleaseLocalMappings();
+
 	class DSMCache
 	{
 	protected:
-#ifdef BD_DSM_STAT
-		unsigned long writes, whit, reads, rhit;
-#endif
+		CacheStat stat;
 	public:
 
 		DSMCache(){}
@@ -116,18 +185,40 @@ namespace Dogee
 		virtual SoStatus getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)=0;
 		virtual SoStatus putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf)=0;
 		virtual SoStatus putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)=0;
-		~DSMCache(){}
-#ifdef BD_DSM_STAT
-		virtual void get_stat(long& mwrites, long& mwhit, long& mreads, long& mrhit)
+
+		/*
+		Write the data that only the cache holds to the backend, so that
+		the backend can be read directly (e.g. by checkpointing)
+		*/
+		virtual void FlushToBackend(){}
+		//called when a thread of this node passes a barrier (see DSMEpochCache)
+		virtual void NewEpoch(){}
+		/*
+		Make the writes of the current thread visible to the other nodes.
+		Called by the synchronization functions (barriers, semaphores,
+		events and thread creation), the DThreadPool submits and the
+		accumulator operations before they notify other nodes
+		*/
+		virtual void Fence(){}
+		/*
+		Keep the blocks of the fields [fldid, fldid+len) of an object in the
+		cache, whatever the other accesses are. Returns SoFail and pins
+		nothing if more than DogeeEnv::CacheConfig::max_pinned_blocks blocks
+		would be pinned. Pins are counted, each Pin should be matched by an
+		Unpin of the same range. Caches without blocks ignore them
+		*/
+		virtual SoStatus Pin(ObjectKey key, FieldKey fldid, uint32_t len)
 		{
-			mwrites = writes;
-			mwhit = whit;
-			mreads = reads;
-			mrhit = rhit;
+			return SoOK;
 		}
-#endif
-
+		virtual void Unpin(ObjectKey key, FieldKey fldid, uint32_t len){}
+		virtual ~DSMCache(){}
 
+		//the hit/miss and protocal counters of the cache
+		CacheStat& GetStat()
+		{
+			return stat;
+		}
 	};
 
 
@@ -135,37 +226,50 @@ namespace Dogee
 	{
 	private:
 		SoStorage* backend;
+		//every access goes to the backend, so it is counted as a miss of the object
+		void count(CacheStatCounter c, ObjectKey key)
+		{
+			stat.Inc(c);
+			stat.Miss(key);
+		}
 	public:
 		DSMNoCache(SoStorage* back) :backend(back)
 		{}
 		SoStatus put(ObjectKey key, FieldKey fldid, uint64_t v)
 		{
+			count(StatWrites, key);
 			return backend->put(key, fldid, v);
 		}
 		SoStatus put(ObjectKey key, FieldKey fldid, uint32_t v)
 		{
+			count(StatWrites, key);
 			return backend->put(key, fldid, v);
 		}
 		uint32_t get(ObjectKey key, FieldKey fldid)
 		{
+			count(StatReads, key);
 			return backend->get(key, fldid);
 		}
 
 
 		virtual SoStatus getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf)
 		{
+			count(StatReads, key);
 			return backend->getchunk(key, fldid, len, buf);
 		}
 		virtual SoStatus getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)
 		{
+			count(StatReads, key);
 			return backend->getchunk(key, fldid, len, buf);
 		}
 		virtual SoStatus putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf)
 		{
+			count(StatWrites, key);
 			return backend->putchunk(key, fldid, len, buf);
 		}
 		virtual SoStatus putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf)
 		{
+			count(StatWrites, key);
 			return backend->putchunk(key, fldid, len, buf);
 		}
 
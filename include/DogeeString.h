@@ -70,7 +70,7 @@ namespace Dogee
 		{
 			bool has_tail = (str.size() % sizeof(uint32_t) != 0);
 			uint32_t size = str.size() / sizeof(uint32_t) + (has_tail ? 1 : 0);
-			ObjectKey okey = AllocObjectId(AutoRegisterObject<DString>::id, 1 + size);
+			ObjectKey okey = AllocObjectId(AutoRegisterObject<DString>::id, 1 + size, ReadOnly);
 			const char* pstr = str.c_str();
 			uint32_t* ptr = (uint32_t*)pstr;
 			DogeeEnv::cache->putchunk(okey, 1, size, ptr);
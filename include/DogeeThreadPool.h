@@ -48,6 +48,11 @@ namespace Dogee
 				threads.push_back(std::move(std::thread(bd)));
 		}
 
+		int GetThreadCount()
+		{
+			return numthreads;
+		}
+
 		template<class _Fty,
 		class... _ArgTypes> inline
 			std::future<typename std::result_of<_Fty(_ArgTypes...)>::type>
@@ -0,0 +1,50 @@
+#ifndef __DOGEE_TRACE_H_
+#define __DOGEE_TRACE_H_
+
+#include <stdint.h>
+
+/*
+The format of the access traces written by DSMTraceCache and read by
+tools/CacheSim. Each thread of each node writes its own file: a
+TraceHeader followed by TraceRecords, in the byte order of the machine.
+*/
+#define TRACE_MAGIC (0x44545243)
+#define TRACE_VERSION 1
+//the max length (in words) of an access in a record. Longer ones are split
+#define TRACE_MAX_LEN 0xffffff
+
+namespace Dogee
+{
+	enum TraceOp
+	{
+		TraceGet,
+		TracePut,
+		TraceGetChunk,
+		TracePutChunk,
+	};
+
+#pragma pack(push)
+#pragma pack(4)
+	struct TraceHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t node;
+		uint32_t thread;
+		//the wall clock time of the start of the file, in microseconds
+		uint64_t start_us;
+	};
+
+	struct TraceRecord
+	{
+		//the address of the first word, (object id << 32) | field id
+		uint64_t addr;
+		//the operation in the highest 8 bits, the length in words in the lower 24 bits
+		uint32_t oplen;
+		//the microseconds since the previous record of the thread, saturated
+		uint32_t dt;
+	};
+#pragma pack(pop)
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef __DOGEE_TRACE_CACHE_H_
+#define __DOGEE_TRACE_CACHE_H_
+
+#include "DogeeStorage.h"
+#include "DogeeTrace.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+//the number of records a thread buffers before writing them to its file
+#define TRACE_BUFFER_RECORDS 4096
+
+namespace Dogee
+{
+	/*
+	Records the accesses to the cache it is put in front of, for the
+	offline cache simulator (tools/CacheSim). Each thread writes the
+	get/put/getchunk/putchunk addresses to its own binary file
+	"<path>.<node>.<thread>.trace" (see DogeeTrace.h). The buffered
+	records are written when the buffer is full and when the cache is
+	deleted. See DogeeEnv::CacheConfig::trace_path.
+	*/
+	class DSMTraceCache : public DSMCache
+	{
+	private:
+		struct TraceWriter
+		{
+			FILE* f;
+			uint64_t last_us;
+			uint32_t n;
+			TraceRecord records[TRACE_BUFFER_RECORDS];
+		};
+		DSMCache* inner;
+		std::string path;
+		int node_id;
+		uint32_t instance_id;
+		std::vector<TraceWriter*> writers;
+		std::mutex writers_lock;
+
+		//the writer of the current thread, created on its first access
+		TraceWriter* writer();
+		void flush(TraceWriter* w);
+		void record(TraceOp op, ObjectKey key, FieldKey fldid, uint32_t len);
+	public:
+		//the trace cache owns "inner" and deletes it on destruction
+		DSMTraceCache(DSMCache* inner, const std::string& path, int node_id);
+		~DSMTraceCache();
+
+		SoStatus put(ObjectKey key, FieldKey fldid, uint64_t v);
+		SoStatus put(ObjectKey key, FieldKey fldid, uint32_t v);
+		uint32_t get(ObjectKey key, FieldKey fldid);
+		SoStatus getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf);
+		SoStatus getchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf);
+		SoStatus putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint64_t* buf);
+		SoStatus putchunk(ObjectKey key, FieldKey fldid, uint32_t len, uint32_t* buf);
+		void FlushToBackend()
+		{
+			inner->FlushToBackend();
+		}
+		void Fence()
+		{
+			inner->Fence();
+		}
+		SoStatus Pin(ObjectKey key, FieldKey fldid, uint32_t len)
+		{
+			return inner->Pin(key, fldid, len);
+		}
+		void Unpin(ObjectKey key, FieldKey fldid, uint32_t len)
+		{
+			inner->Unpin(key, fldid, len);
+		}
+		void NewEpoch()
+		{
+			inner->NewEpoch();
+		}
+		DSMCache* GetInner()
+		{
+			return inner;
+		}
+	};
+}
+
+#endif
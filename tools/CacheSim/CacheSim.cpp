@@ -0,0 +1,422 @@
+/*
+Replays the access traces written with DogeeEnv::CacheConfig::trace_path
+through a model of the caches of the nodes, and reports the hits, misses
+and protocal messages each node would have with another cache size,
+block size, replacement policy or coherence mode.
+
+usage: CacheSim [-s cache_size] [-b block_size] [-p lru|clock|fifo]
+	[-c update|invalidate] [-n nodes] trace_files...
+
+Sizes are in bytes and may end with K, M or G. The defaults are those
+of DSMDirectoryCache: 128K caches of 128-byte blocks, LRU and updates.
+The accesses of all the files are replayed in the order of their time
+stamps. As in DSMDirectoryCache, the home of block b is b % nodes. Every
+request sent to another node and its reply count as two messages, and
+write-backs, updates and invalidations as one.
+*/
+#include "DogeeTrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <queue>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+
+using namespace Dogee;
+
+class CacheModel
+{
+public:
+	//returns true if the block is cached, and counts it as an access to the block
+	virtual bool Touch(uint64_t blk) = 0;
+	//add a block which is not cached. Returns true and sets "victim" if a block is swapped out
+	virtual bool Insert(uint64_t blk, uint64_t& victim) = 0;
+	virtual void Remove(uint64_t blk) = 0;
+	virtual ~CacheModel(){}
+};
+
+//LRU, or FIFO if the hits do not change the order
+class ListCache : public CacheModel
+{
+private:
+	size_t capacity;
+	bool move_on_hit;
+	std::list<uint64_t> order;
+	std::unordered_map<uint64_t, std::list<uint64_t>::iterator> pos;
+public:
+	ListCache(size_t capacity, bool move_on_hit) : capacity(capacity), move_on_hit(move_on_hit)
+	{}
+	bool Touch(uint64_t blk)
+	{
+		auto itr = pos.find(blk);
+		if (itr == pos.end())
+			return false;
+		if (move_on_hit)
+			order.splice(order.begin(), order, itr->second);
+		return true;
+	}
+	bool Insert(uint64_t blk, uint64_t& victim)
+	{
+		bool evicted = false;
+		if (order.size() >= capacity)
+		{
+			victim = order.back();
+			pos.erase(victim);
+			order.pop_back();
+			evicted = true;
+		}
+		order.push_front(blk);
+		pos[blk] = order.begin();
+		return evicted;
+	}
+	void Remove(uint64_t blk)
+	{
+		auto itr = pos.find(blk);
+		if (itr != pos.end())
+		{
+			order.erase(itr->second);
+			pos.erase(itr);
+		}
+	}
+};
+
+class ClockCache : public CacheModel
+{
+private:
+	std::vector<uint64_t> slots;
+	std::vector<bool> referenced;
+	std::vector<size_t> free_slots;
+	std::unordered_map<uint64_t, size_t> pos;
+	size_t hand;
+public:
+	ClockCache(size_t capacity) : slots(capacity), referenced(capacity, false), hand(0)
+	{
+		for (size_t i = capacity; i > 0; i--)
+			free_slots.push_back(i - 1);
+	}
+	bool Touch(uint64_t blk)
+	{
+		auto itr = pos.find(blk);
+		if (itr == pos.end())
+			return false;
+		referenced[itr->second] = true;
+		return true;
+	}
+	bool Insert(uint64_t blk, uint64_t& victim)
+	{
+		bool evicted = false;
+		size_t slot;
+		if (!free_slots.empty())
+		{
+			slot = free_slots.back();
+			free_slots.pop_back();
+		}
+		else
+		{
+			while (referenced[hand])
+			{
+				referenced[hand] = false;
+				hand = (hand + 1) % slots.size();
+			}
+			slot = hand;
+			hand = (hand + 1) % slots.size();
+			victim = slots[slot];
+			pos.erase(victim);
+			evicted = true;
+		}
+		slots[slot] = blk;
+		referenced[slot] = true;
+		pos[blk] = slot;
+		return evicted;
+	}
+	void Remove(uint64_t blk)
+	{
+		auto itr = pos.find(blk);
+		if (itr != pos.end())
+		{
+			referenced[itr->second] = false;
+			free_slots.push_back(itr->second);
+			pos.erase(itr);
+		}
+	}
+};
+
+struct NodeStat
+{
+	uint64_t reads = 0;
+	uint64_t read_hits = 0;
+	uint64_t writes = 0;
+	uint64_t write_hits = 0;
+	uint64_t evictions = 0;
+	uint64_t messages = 0;
+};
+
+class Simulator
+{
+private:
+	int nodes;
+	uint32_t block_bits;
+	bool invalidate;
+	std::vector<std::unique_ptr<CacheModel>> caches;
+	std::vector<NodeStat> stats;
+	//the nodes caching each block
+	std::unordered_map<uint64_t, std::vector<int>> sharers;
+
+	void message(int from, int to)
+	{
+		if (from != to)
+			stats[from].messages++;
+	}
+	void remove_sharer(uint64_t blk, int node)
+	{
+		auto itr = sharers.find(blk);
+		if (itr == sharers.end())
+			return;
+		std::vector<int>& s = itr->second;
+		s.erase(std::remove(s.begin(), s.end(), node), s.end());
+		if (s.empty())
+			sharers.erase(itr);
+	}
+	void access_block(int node, bool write, uint64_t blk)
+	{
+		NodeStat& s = stats[node];
+		int home = (int)(blk % nodes);
+		bool hit = caches[node]->Touch(blk);
+		if (write)
+		{
+			s.writes++;
+			if (hit)
+				s.write_hits++;
+		}
+		else
+		{
+			s.reads++;
+			if (hit)
+				s.read_hits++;
+		}
+		//a miss and a write hit both take a round trip to the home
+		if (!hit || write)
+		{
+			message(node, home);
+			message(home, node);
+		}
+		if (!hit)
+		{
+			uint64_t victim;
+			if (caches[node]->Insert(blk, victim))
+			{
+				s.evictions++;
+				message(node, (int)(victim % nodes));
+				remove_sharer(victim, node);
+			}
+			std::vector<int>& sh = sharers[blk];
+			if (std::find(sh.begin(), sh.end(), node) == sh.end())
+				sh.push_back(node);
+		}
+		if (write)
+		{
+			std::vector<int> others = sharers[blk];
+			for (int o : others)
+			{
+				if (o == node)
+					continue;
+				message(home, o);
+				if (invalidate)
+				{
+					caches[o]->Remove(blk);
+					remove_sharer(blk, o);
+				}
+			}
+		}
+	}
+public:
+	Simulator(int nodes, uint32_t block_bits, size_t blocks, const std::string& policy, bool invalidate)
+		: nodes(nodes), block_bits(block_bits), invalidate(invalidate), stats(nodes)
+	{
+		for (int i = 0; i < nodes; i++)
+		{
+			if (policy == "clock")
+				caches.emplace_back(new ClockCache(blocks));
+			else
+				caches.emplace_back(new ListCache(blocks, policy == "lru"));
+		}
+	}
+	void Access(int node, const TraceRecord& r)
+	{
+		uint32_t op = r.oplen >> 24;
+		uint32_t len = r.oplen & TRACE_MAX_LEN;
+		if (!len)
+			return;
+		bool write = (op == TracePut || op == TracePutChunk);
+		uint64_t last = (r.addr + len - 1) >> block_bits;
+		for (uint64_t blk = r.addr >> block_bits; blk <= last; blk++)
+			access_block(node, write, blk);
+	}
+	void Report()
+	{
+		NodeStat total;
+		printf("%6s %12s %12s %12s %12s %9s %12s %12s\n", "node", "reads", "writes", "hits", "misses", "hit_rate", "evictions", "messages");
+		for (int i = 0; i <= nodes; i++)
+		{
+			NodeStat& s = (i < nodes) ? stats[i] : total;
+			if (i < nodes)
+			{
+				total.reads += s.reads;
+				total.read_hits += s.read_hits;
+				total.writes += s.writes;
+				total.write_hits += s.write_hits;
+				total.evictions += s.evictions;
+				total.messages += s.messages;
+			}
+			uint64_t accesses = s.reads + s.writes;
+			uint64_t hits = s.read_hits + s.write_hits;
+			char name[16];
+			if (i < nodes)
+				snprintf(name, sizeof(name), "%d", i);
+			else
+				strcpy(name, "all");
+			printf("%6s %12llu %12llu %12llu %12llu %8.2f%% %12llu %12llu\n", name,
+				(unsigned long long)s.reads, (unsigned long long)s.writes, (unsigned long long)hits,
+				(unsigned long long)(accesses - hits), accesses ? 100.0 * hits / accesses : 0.0,
+				(unsigned long long)s.evictions, (unsigned long long)s.messages);
+		}
+	}
+};
+
+struct TraceFile
+{
+	TraceHeader header;
+	std::vector<TraceRecord> records;
+	size_t next;
+	uint64_t time;
+};
+
+static bool LoadTrace(const char* path, TraceFile& t)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f)
+	{
+		printf("Cannot open %s\n", path);
+		return false;
+	}
+	if (fread(&t.header, sizeof(t.header), 1, f) != 1 || t.header.magic != TRACE_MAGIC || t.header.version != TRACE_VERSION)
+	{
+		printf("%s is not a trace file\n", path);
+		fclose(f);
+		return false;
+	}
+	TraceRecord r;
+	while (fread(&r, sizeof(r), 1, f) == 1)
+		t.records.push_back(r);
+	fclose(f);
+	t.next = 0;
+	t.time = t.header.start_us;
+	return true;
+}
+
+static size_t ParseSize(const char* str)
+{
+	char* end;
+	size_t ret = strtoull(str, &end, 10);
+	switch (*end)
+	{
+	case 'G': case 'g':
+		ret <<= 10;
+		//fall through
+	case 'M': case 'm':
+		ret <<= 10;
+		//fall through
+	case 'K': case 'k':
+		ret <<= 10;
+	}
+	return ret;
+}
+
+static void Usage()
+{
+	printf("usage: CacheSim [-s cache_size] [-b block_size] [-p lru|clock|fifo] [-c update|invalidate] [-n nodes] trace_files...\n");
+}
+
+int main(int argc, char* argv[])
+{
+	size_t cache_size = 128 << 10;
+	size_t block_size = 128;
+	std::string policy = "lru";
+	std::string coherence = "update";
+	int nodes = 0;
+	std::vector<TraceFile> files;
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] == '-' && i + 1 < argc)
+		{
+			const char* val = argv[++i];
+			switch (argv[i - 1][1])
+			{
+			case 's':
+				cache_size = ParseSize(val);
+				break;
+			case 'b':
+				block_size = ParseSize(val);
+				break;
+			case 'p':
+				policy = val;
+				break;
+			case 'c':
+				coherence = val;
+				break;
+			case 'n':
+				nodes = atoi(val);
+				break;
+			default:
+				Usage();
+				return 1;
+			}
+			continue;
+		}
+		files.emplace_back();
+		if (!LoadTrace(argv[i], files.back()))
+			return 1;
+	}
+	uint32_t block_bits = 0;
+	while (((size_t)4 << block_bits) < block_size)
+		block_bits++;
+	if (files.empty() || ((size_t)4 << block_bits) != block_size || cache_size < block_size
+		|| (policy != "lru" && policy != "clock" && policy != "fifo")
+		|| (coherence != "update" && coherence != "invalidate"))
+	{
+		Usage();
+		return 1;
+	}
+	for (TraceFile& t : files)
+		nodes = std::max(nodes, (int)t.header.node + 1);
+
+	Simulator sim(nodes, block_bits, cache_size / block_size, policy, coherence == "invalidate");
+	//replay the records of all the threads by their time stamps
+	typedef std::pair<uint64_t, size_t> QueueItem;
+	std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (!files[i].records.empty())
+			queue.push(QueueItem(files[i].time + files[i].records[0].dt, i));
+	}
+	uint64_t records = 0;
+	while (!queue.empty())
+	{
+		TraceFile& t = files[queue.top().second];
+		t.time = queue.top().first;
+		queue.pop();
+		if (t.header.node < (uint32_t)nodes)
+			sim.Access(t.header.node, t.records[t.next]);
+		records++;
+		if (++t.next < t.records.size())
+			queue.push(QueueItem(t.time + t.records[t.next].dt, &t - &files[0]));
+	}
+	printf("%llu records of %d nodes, %s cache of %llu bytes, %llu-byte blocks, %s\n", (unsigned long long)records, nodes,
+		policy.c_str(), (unsigned long long)cache_size, (unsigned long long)block_size, coherence.c_str());
+	sim.Report();
+	return 0;
+}